@@ -0,0 +1,48 @@
+/*
+	Helpers shared by the benchmarks
+*/
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "slab.h"
+#include "buddy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+// Monotonic time in nanoseconds
+static inline double bench_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+
+// Argument i as a number, def if it is missing
+static inline long bench_arg(int argc, char **argv, int i, long def)
+{
+	return argc > i && atol(argv[i]) > 0 ? atol(argv[i]) : def;
+}
+
+
+// Give the allocator a heap of mb megabytes
+static inline void bench_heap(size_t mb)
+{
+	void *space = aligned_alloc(BLOCK_SIZE, mb << 20);
+
+	if (space == NULL)
+	{
+		fprintf(stderr, "No memory for a %zu MB heap\n", mb);
+		exit(1);
+	}
+
+	kmem_init(space, (mb << 20) / BLOCK_SIZE);
+}
+
+
+#endif //BENCH_H_
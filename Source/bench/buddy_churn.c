@@ -0,0 +1,64 @@
+/*
+	Buddy split and merge churn
+
+	A few slabs grow and shrink over and over, as a cache does when its
+	objects come and go in bursts. Every free of a small block next to a
+	free buddy merges all the way up, and the next allocation splits the
+	large chunk again. The build makes one binary that coalesces eagerly and
+	one with BUDDY_LAZY.
+
+	Usage: bench_buddy_<variant> [cycles]
+*/
+
+#include "bench.h"
+
+// Slabs that grow and shrink
+#define SLABS 8
+
+// Heap blocks
+#define HEAP_BLOCKS 16384
+
+
+int main(int argc, char **argv)
+{
+	long cycles = bench_arg(argc, argv, 1, 2000000), i;
+	block_area_t slabs[SLABS];
+	void *space;
+	double start, elapsed;
+	int j;
+
+	space = aligned_alloc(BLOCK_SIZE, (size_t)HEAP_BLOCKS * BLOCK_SIZE);
+
+	if (space == NULL || buddy_init(space, HEAP_BLOCKS) != 0)
+	{
+		fprintf(stderr, "Buddy allocator setup failed\n");
+		return 1;
+	}
+
+	// Orders 0 to 2, as slabs of small and larger objects take
+	for (j = 0; j < SLABS; j++)
+		slabs[j] = buddy_alloc(j % 3);
+
+	start = bench_now_ns();
+
+	// Each cycle gives one slab back and takes it again
+	for (i = 0; i < cycles; i++)
+	{
+		j = (int)(i % SLABS);
+
+		buddy_free(&slabs[j]);
+		slabs[j] = buddy_alloc(j % 3);
+
+		if (slabs[j].addr == NULL)
+		{
+			fprintf(stderr, "Allocation failed\n");
+			return 1;
+		}
+	}
+
+	elapsed = bench_now_ns() - start;
+
+	printf("%s: %.1f ns per free/alloc pair\n", BENCH_VARIANT, elapsed / cycles);
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+	Allocator on a sparsely touched terabyte mapping
+
+	Reserves address space without backing it, runs kmem_init over all of
+	it and times kmalloc and kfree of a few sizes, from slab buffers up to
+	large buddy allocations. Only the pages that are handed out and written
+	get memory, the block map included, which the resident size printed at
+	the end shows.
+
+	Usage: bench_buddy_sparse [gigabytes] [operations]
+*/
+
+#include "bench.h"
+#include <sys/mman.h>
+
+// Allocation sizes in blocks, one after another
+static const size_t sizes[] = {1, 3, 16, 250, 4096};
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+// Allocations held at once
+#define LIVE 64
+
+
+// Resident size of this process in megabytes
+double resident_mb(void)
+{
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm)
+	{
+		if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+
+		fclose(statm);
+	}
+
+	return (double)resident * 4096 / (1 << 20);
+}
+
+
+int main(int argc, char **argv)
+{
+	long gigabytes = bench_arg(argc, argv, 1, 4096), operations = bench_arg(argc, argv, 2, 1000000), i;
+	size_t size = (size_t)gigabytes << 30;
+	block_count_t blocks = size / BLOCK_SIZE;
+	void *space, *live[LIVE] = {0};
+	double start, init_ns, op_ns;
+	int j;
+
+	space = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (space == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	start = bench_now_ns();
+
+	// The path of any caller, nothing is known about the contents of space
+	kmem_init(space, blocks);
+
+	init_ns = bench_now_ns() - start;
+	start = bench_now_ns();
+
+	for (i = 0; i < operations; i++)
+	{
+		j = (int)(i % LIVE);
+
+		if (live[j])
+			kfree(live[j]);
+
+		live[j] = kmalloc(sizes[i % SIZE_COUNT] * BLOCK_SIZE);
+
+		if (live[j] == NULL)
+		{
+			fprintf(stderr, "Allocation of %zu blocks failed\n", sizes[i % SIZE_COUNT]);
+			return 1;
+		}
+
+		// Touch the block, as a user would
+		*(char*)live[j] = 1;
+	}
+
+	op_ns = (bench_now_ns() - start) / operations;
+
+	printf("%s: %ld GB (%llu blocks), init %.3f ms, %.1f ns per free/alloc pair, %.1f MB resident\n",
+		BENCH_VARIANT, gigabytes, (unsigned long long)blocks, init_ns / 1e6, op_ns, resident_mb());
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+	Standard containers on kmem::allocator and std::allocator
+
+	The same vector, map and list workloads run once with each allocator.
+	Vectors grow by reallocation and take size-N buffers, map and list nodes
+	come one at a time from the per-type object caches.
+
+	Usage: bench_containers [elements] [rounds]
+*/
+
+#include "bench.h"
+#include "kmem_allocator.hpp"
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+
+// Keeps the results alive so the workloads are not optimised out
+volatile long long sink;
+
+
+// Random number (xorshift)
+static unsigned long long next_random(unsigned long long *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+
+// Run the workloads with allocator A and print the time per element
+template<template<class> class A>
+void run(const char *name, long elements, long rounds)
+{
+	unsigned long long state = 88172645463325252ull;
+	double start, vector_ns, map_ns, list_ns;
+	long round, i;
+	long long sum = 0;
+
+	start = bench_now_ns();
+
+	// Grow from empty every round, so every reallocation step is paid again
+	for (round = 0; round < rounds; round++)
+	{
+		std::vector<long, A<long>> values;
+
+		for (i = 0; i < elements; i++)
+			values.push_back(i);
+
+		sum += values.back();
+	}
+
+	vector_ns = (bench_now_ns() - start) / ((double)rounds * elements);
+	start = bench_now_ns();
+
+	for (round = 0; round < rounds; round++)
+	{
+		std::map<long, long, std::less<long>, A<std::pair<const long, long>>> index;
+
+		for (i = 0; i < elements; i++)
+			index[(long)(next_random(&state) % (elements * 4))] = i;
+
+		// Half of the nodes go before the map is torn down
+		for (i = 0; i < elements / 2; i++)
+			index.erase((long)(next_random(&state) % (elements * 4)));
+
+		sum += (long long)index.size();
+	}
+
+	map_ns = (bench_now_ns() - start) / ((double)rounds * elements);
+	start = bench_now_ns();
+
+	for (round = 0; round < rounds; round++)
+	{
+		std::list<long, A<long>> queue;
+
+		// Queue traffic: the list never holds more than a quarter of the elements
+		for (i = 0; i < elements; i++)
+		{
+			queue.push_back(i);
+
+			if (queue.size() > (size_t)elements / 4)
+				queue.pop_front();
+		}
+
+		sum += queue.front();
+	}
+
+	list_ns = (bench_now_ns() - start) / ((double)rounds * elements);
+
+	sink = sum;
+
+	printf("%s: %-15s vector %.1f ns, map %.1f ns, list %.1f ns per element\n",
+		BENCH_VARIANT, name, vector_ns, map_ns, list_ns);
+}
+
+
+int main(int argc, char **argv)
+{
+	long elements = bench_arg(argc, argv, 1, 100000), rounds = bench_arg(argc, argv, 2, 20);
+
+	bench_heap(256);
+
+	run<std::allocator>("std::allocator", elements, rounds);
+	run<kmem::allocator>("kmem::allocator", elements, rounds);
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+	Neighbouring caches used from different threads
+
+	Each thread allocates and frees from a cache of its own, so no lock is
+	contended. The descriptors of caches created one after another sit next
+	to each other in kmem_cache, and any line they share bounces between
+	the threads. The build makes one binary with the padded descriptor
+	layout and one with KMEM_PACKED_CACHES.
+
+	Usage: bench_sharing_<variant> [threads] [operations per thread]
+*/
+
+#include "bench.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// Objects a thread holds at once
+#define BATCH 16
+
+// Operations per thread
+long operations;
+
+
+// Caches without a constructor would be merged into one, so each gets an empty one
+void no_ctor(void *obj)
+{
+	(void)obj;
+}
+
+
+// Allocate and free BATCH objects at a time from the cache in arg
+void *worker(void *arg)
+{
+	kmem_cache_t *cache = (kmem_cache_t*)arg;
+	void *objects[BATCH];
+	long i;
+	int j;
+
+	for (i = 0; i < operations; i += BATCH)
+	{
+		for (j = 0; j < BATCH; j++)
+			objects[j] = kmem_cache_alloc(cache);
+
+		for (j = 0; j < BATCH; j++)
+			kmem_cache_free(cache, objects[j]);
+	}
+
+	return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+	long threads = bench_arg(argc, argv, 1, sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 2), i;
+	kmem_cache_t **caches;
+	pthread_t *ids;
+	char name[32];
+	double start, elapsed;
+
+	operations = bench_arg(argc, argv, 2, 2000000);
+	ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	caches = (kmem_cache_t**)malloc(threads * sizeof(kmem_cache_t*));
+
+	bench_heap(64);
+
+	for (i = 0; i < threads; i++)
+	{
+		sprintf(name, "bench-%ld", i);
+		caches[i] = kmem_cache_create(name, 64, no_ctor, NULL);
+	}
+
+	start = bench_now_ns();
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, worker, caches[i]);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	elapsed = bench_now_ns() - start;
+
+	printf("%s: %ld threads, descriptors %zu bytes apart, %.1f ns per alloc/free pair, %.2f M pairs/s\n", BENCH_VARIANT, threads,
+		(size_t)((char*)caches[1] - (char*)caches[0]), elapsed / (threads * operations), threads * operations / elapsed * 1e3);
+
+	return 0;
+}
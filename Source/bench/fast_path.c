@@ -0,0 +1,57 @@
+/*
+	Cost of one allocation and free on the fast path
+
+	One thread allocates and frees from a cache and through kmalloc, so
+	every call finds a free object at hand. The build makes one binary with
+	the default locks and one with KMEM_SINGLE_THREAD, where the lock calls
+	compile to nothing.
+
+	Usage: bench_fastpath_<variant> [operations]
+*/
+
+#include "bench.h"
+
+// Objects held at once
+#define BATCH 32
+
+
+int main(int argc, char **argv)
+{
+	long operations = bench_arg(argc, argv, 1, 10000000), i;
+	void *objects[BATCH];
+	kmem_cache_t *cache;
+	double start, cache_ns, kmalloc_ns;
+	int j;
+
+	bench_heap(64);
+	cache = kmem_cache_create("bench", 64, NULL, NULL);
+
+	start = bench_now_ns();
+
+	for (i = 0; i < operations; i += BATCH)
+	{
+		for (j = 0; j < BATCH; j++)
+			objects[j] = kmem_cache_alloc(cache);
+
+		for (j = 0; j < BATCH; j++)
+			kmem_cache_free(cache, objects[j]);
+	}
+
+	cache_ns = (bench_now_ns() - start) / operations;
+	start = bench_now_ns();
+
+	for (i = 0; i < operations; i += BATCH)
+	{
+		for (j = 0; j < BATCH; j++)
+			objects[j] = kmalloc(100);
+
+		for (j = 0; j < BATCH; j++)
+			kfree(objects[j]);
+	}
+
+	kmalloc_ns = (bench_now_ns() - start) / operations;
+
+	printf("%s: kmem_cache_alloc/free %.1f ns, kmalloc/kfree %.1f ns per pair\n", BENCH_VARIANT, cache_ns, kmalloc_ns);
+
+	return 0;
+}
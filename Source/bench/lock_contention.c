@@ -0,0 +1,75 @@
+/*
+	Allocator lock under contention
+
+	Every thread allocates and frees objects of one cache, so all of them
+	queue on its lock. The build makes one binary per lock implementation.
+	Threads default to the online CPUs, and at least two so there is
+	contention.
+
+	Usage: bench_lock_<variant> [threads] [operations per thread]
+*/
+
+#include "bench.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// Objects a thread holds at once
+#define BATCH 16
+
+// Shared cache
+kmem_cache_t *cache;
+
+// Operations per thread
+long operations;
+
+
+// Allocate and free BATCH objects at a time
+void *worker(void *arg)
+{
+	void *objects[BATCH];
+	long i;
+	int j;
+
+	(void)arg;
+
+	for (i = 0; i < operations; i += BATCH)
+	{
+		for (j = 0; j < BATCH; j++)
+			objects[j] = kmem_cache_alloc(cache);
+
+		for (j = 0; j < BATCH; j++)
+			kmem_cache_free(cache, objects[j]);
+	}
+
+	return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN), threads = bench_arg(argc, argv, 1, cpus > 2 ? cpus : 2), i;
+	pthread_t *ids;
+	double start, elapsed;
+
+	operations = bench_arg(argc, argv, 2, 1000000);
+	ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+
+	bench_heap(64);
+	cache = kmem_cache_create("bench", 64, NULL, NULL);
+
+	start = bench_now_ns();
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, worker, NULL);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	elapsed = bench_now_ns() - start;
+
+	// Each operation is one allocation and one free
+	printf("%s: %ld threads, %.1f ns per alloc/free pair, %.2f M pairs/s\n", BENCH_VARIANT, threads,
+		elapsed / (threads * operations), threads * operations / elapsed * 1e3);
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+	Resident slabs under long-running churn
+
+	The cache first grows to four times the live set, then random frees
+	leave objects spread thinly over all its slabs. From there on every
+	step frees a random object and allocates a new one, and every round
+	the empty slabs go back to the buddy allocator. The blocks that still
+	hold live objects show how well allocation packs the survivors. The build makes one
+	binary with occupancy buckets for partial slabs and one with a single
+	partial list.
+
+	Usage: bench_churn_<variant> [live objects] [rounds]
+*/
+
+#include "bench.h"
+
+// Object size
+#define OBJECT_SIZE 96
+
+// A round replaces 1/ROUND_FRACTION of the live set
+#define ROUND_FRACTION 10
+
+
+// Random number (xorshift)
+unsigned long long next_random(void)
+{
+	static unsigned long long state = 88172645463325252ull;
+
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+
+	return state;
+}
+
+
+// Order of two block numbers
+int compare_blocks(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+// Distinct blocks holding the count objects
+unsigned long long blocks_in_use(void **objects, long count, unsigned long *blocks)
+{
+	unsigned long long distinct = 0;
+	long i;
+
+	for (i = 0; i < count; i++)
+		blocks[i] = (unsigned long)((size_t)objects[i] / BLOCK_SIZE);
+
+	qsort(blocks, count, sizeof(unsigned long), compare_blocks);
+
+	for (i = 0; i < count; i++)
+		distinct += i == 0 || blocks[i] != blocks[i - 1];
+
+	return distinct;
+}
+
+
+int main(int argc, char **argv)
+{
+	long live = bench_arg(argc, argv, 1, 50000), rounds = bench_arg(argc, argv, 2, 30), round, step, i, j, count;
+	unsigned long long first = 0, last = 0;
+	unsigned long *blocks;
+	kmem_cache_t *cache;
+	void **objects;
+	double start, elapsed = 0;
+
+	objects = (void**)malloc(4 * live * sizeof(void*));
+	blocks = (unsigned long*)malloc(live * sizeof(unsigned long));
+
+	bench_heap(256);
+	cache = kmem_cache_create("churn", OBJECT_SIZE, NULL, NULL);
+
+	for (count = 0; count < 4 * live; count++)
+		objects[count] = kmem_cache_alloc(cache);
+
+	// Random frees leave every slab about a quarter full
+	while (count > live)
+	{
+		j = (long)(next_random() % count);
+		kmem_cache_free(cache, objects[j]);
+		objects[j] = objects[--count];
+	}
+
+	for (round = 0; round < rounds; round++)
+	{
+		start = bench_now_ns();
+
+		for (step = 0; step < live / ROUND_FRACTION; step++)
+		{
+			j = (long)(next_random() % count);
+			kmem_cache_free(cache, objects[j]);
+			objects[j] = kmem_cache_alloc(cache);
+		}
+
+		kmem_cache_shrink(cache);
+		elapsed += bench_now_ns() - start;
+		last = blocks_in_use(objects, count, blocks);
+
+		if (round == 0)
+			first = last;
+	}
+
+	printf("%s: %ld live objects of %d bytes, %llu blocks in use after the first round, %llu after %ld rounds (%lu needed), %.1f ns per step\n",
+		BENCH_VARIANT, live, OBJECT_SIZE, first, last, rounds,
+		(unsigned long)(((size_t)live * OBJECT_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE),
+		elapsed / ((double)rounds * (live / ROUND_FRACTION)));
+
+	for (i = 0; i < count; i++)
+		kmem_cache_free(cache, objects[i]);
+
+	return 0;
+}
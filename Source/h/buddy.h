@@ -18,25 +18,29 @@
 #define CACHE_L1_LINE_SIZE 64
 #endif
 
-// Maximum order of two, 128GB limit
-#define MAX_ORDER_LIMIT 25
+// Maximum order of two, 4PB limit
+#define MAX_ORDER_LIMIT 40
 
-// Size conversions
-#define size_in_blocks(size) (size/BLOCK_SIZE + (size%BLOCK_SIZE != 0))
-#define size_of_blocks(order) ((1<<order)*BLOCK_SIZE)
-#define size_in_bytes(block_count) (BLOCK_SIZE*block_count)
-#define size_in_L1(size) (size/CACHE_L1_LINE_SIZE + (size%CACHE_L1_LINE_SIZE != 0))
-
-// Power of two calculations
-#define power_of_two(order) (unsigned int)(1<<order)
-unsigned int calc_block_order(size_t size);
-unsigned int calc_max_order(unsigned int num);
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Size in blocks
-typedef unsigned long block_count_t;
+typedef unsigned long long block_count_t;
 
 // Block index
-typedef unsigned long block_index_t;
+typedef unsigned long long block_index_t;
+
+// Size conversions
+#define size_in_blocks(size) ((block_count_t)((size)/BLOCK_SIZE + ((size)%BLOCK_SIZE != 0)))
+#define size_of_blocks(order) ((size_t)power_of_two(order)*BLOCK_SIZE)
+#define size_in_bytes(block_count) ((size_t)BLOCK_SIZE*(block_count))
+#define size_in_L1(size) ((size)/CACHE_L1_LINE_SIZE + ((size)%CACHE_L1_LINE_SIZE != 0))
+
+// Power of two calculations
+#define power_of_two(order) ((block_count_t)1 << (order))
+unsigned int calc_block_order(size_t size);
+unsigned int calc_max_order(block_count_t num);
 
 
 // Block area hook
@@ -44,20 +48,55 @@ typedef struct block_area
 {
 	void* addr;
 	unsigned int order;
+	char zero;
 }block_area_t;
 
 
 // Initialize buddy system
 int buddy_init(void* mem_space, block_count_t block_count);
 
+// Initialize buddy system in zero filled memory (allocations report known-zero blocks)
+int buddy_init_zeroed(void* mem_space, block_count_t block_count);
+
+// Resume a buddy system initialized earlier in space
+int buddy_attach(void* space);
+
 // Allocate 2^order blocks
 block_area_t buddy_alloc(unsigned int order);
 
 // Free 2^order blocks	
 int buddy_free(block_area_t *block_area);   
 
+// Allocate exactly count contiguous blocks (*zero set if they are known to be zero)
+void *buddy_alloc_blocks(block_count_t count, char *zero);
+
+// Free count blocks allocated by buddy_alloc_blocks
+int buddy_free_blocks(void *addr, block_count_t count);
+
 // Allocate space for kernel control structure
 void *kernel_ctrl_alloc(size_t size);
 
+// Address returned by the first kernel_ctrl_alloc
+void *kernel_ctrl_first(void);
+
+// Number of blocks managed (including the control block)
+block_count_t buddy_block_count(void);
+
+// Number of free blocks
+block_count_t buddy_free_block_count(void);
+
+// Number of free chunks of 2^order blocks
+block_count_t buddy_free_chunks(unsigned int order);
+
+// Index of the block containing addr
+block_index_t buddy_index_of(void *addr);
+
+// Address of block index
+void *buddy_block_addr(block_index_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
 
 #endif //BUDDY_H_
\ No newline at end of file
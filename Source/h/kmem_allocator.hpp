@@ -0,0 +1,134 @@
+/*
+	Standard allocator and memory resource over kmalloc
+*/
+
+#ifndef KMEM_ALLOCATOR_HPP_
+#define KMEM_ALLOCATOR_HPP_
+
+#include "slab.h"
+#include "object_cache.hpp"
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+
+namespace kmem {
+
+	// Container allocator: single nodes come from a per-type cache, arrays from size-N buffers
+	template<class T>
+	class allocator
+	{
+	public:
+
+		typedef T value_type;
+
+		allocator() noexcept
+		{
+		}
+
+		template<class U>
+		allocator(const allocator<U> &) noexcept
+		{
+		}
+
+		T *allocate(size_t n)
+		{
+			void *mem;
+
+			if (n == 1)
+			{
+				mem = object_cache<T>::instance().allocate();
+			}
+			else
+			{
+				if (n > (size_t)-1 / sizeof(T))
+					throw std::bad_alloc();
+
+				mem = kmalloc_aligned(n * sizeof(T), alignof(T));
+			}
+
+			if (mem == nullptr)
+				throw std::bad_alloc();
+
+			return static_cast<T*>(mem);
+		}
+
+		void deallocate(T *obj, size_t n) noexcept
+		{
+			if (n == 1)
+			{
+				object_cache<T>::instance().deallocate(obj);
+			}
+			else if (alignof(T) <= alignof(void*))
+			{
+				kfree_sized(obj, n * sizeof(T));
+			}
+			else
+			{
+				kfree(obj);
+			}
+		}
+	};
+
+	template<class T, class U>
+	bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+	{
+		return true;
+	}
+
+	template<class T, class U>
+	bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+	{
+		return false;
+	}
+
+
+	// Polymorphic memory resource backed by size-N buffers
+	class memory_resource : public std::pmr::memory_resource
+	{
+	protected:
+
+		void *do_allocate(size_t bytes, size_t alignment) override
+		{
+			void *mem = nullptr;
+
+			if (bytes == 0)
+				bytes = 1;
+
+			mem = alignment > alignof(void*) ? kmalloc_aligned(bytes, alignment) : kmalloc(bytes);
+
+			if (mem == nullptr)
+				throw std::bad_alloc();
+
+			return mem;
+		}
+
+		void do_deallocate(void *mem, size_t bytes, size_t alignment) override
+		{
+			if (alignment > alignof(void*))
+			{
+				kfree(mem);
+			}
+			else
+			{
+				kfree_sized(mem, bytes == 0 ? 1 : bytes);
+			}
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+		{
+			return dynamic_cast<const memory_resource*>(&other) != nullptr;
+		}
+	};
+
+	// Shared kmalloc-backed memory resource
+	inline memory_resource *get_memory_resource() noexcept
+	{
+		static memory_resource resource;
+		return &resource;
+	}
+
+}
+
+
+#endif //KMEM_ALLOCATOR_HPP_
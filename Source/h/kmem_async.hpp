@@ -0,0 +1,77 @@
+/*
+	Awaitable cache allocation for C++20 coroutines
+*/
+
+#ifndef KMEM_ASYNC_HPP_
+#define KMEM_ASYNC_HPP_
+
+#include "slab.h"
+#include <coroutine>
+
+
+namespace kmem {
+
+	// co_await suspends until an object is free, the coroutine resumes on the freeing thread
+	// The result is nullptr if the request fails or the cache is destroyed while the coroutine waits
+	class alloc_awaiter
+	{
+	public:
+
+		explicit alloc_awaiter(kmem_cache_t *cachep) noexcept : cachep(cachep)
+		{
+		}
+
+		alloc_awaiter(const alloc_awaiter &) = delete;
+		alloc_awaiter &operator=(const alloc_awaiter &) = delete;
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) noexcept
+		{
+			void *mem = nullptr;
+
+			this->handle = handle;
+
+			// Once queued the coroutine may already run on another thread, this is not touched again
+			if (kmem_cache_alloc_async(cachep, &waiter, &alloc_awaiter::complete, this, &mem) == 1)
+				return true;
+
+			// Allocated, or nullptr on error, either way the coroutine goes on now
+			obj = mem;
+			return false;
+		}
+
+		void *await_resume() const noexcept
+		{
+			return obj;
+		}
+
+	private:
+
+		kmem_cache_t *cachep;
+		kmem_waiter_t waiter;
+		std::coroutine_handle<> handle;
+		void *obj = nullptr;
+
+		static void complete(void *mem, void *arg)
+		{
+			alloc_awaiter *self = static_cast<alloc_awaiter*>(arg);
+
+			self->obj = mem;
+			self->handle.resume();
+		}
+	};
+
+	// Allocate one object from cachep, waiting for a free one instead of failing
+	inline alloc_awaiter alloc_async(kmem_cache_t *cachep) noexcept
+	{
+		return alloc_awaiter(cachep);
+	}
+
+}
+
+
+#endif //KMEM_ASYNC_HPP_
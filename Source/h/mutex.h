@@ -1,5 +1,5 @@
 /*
-	C API for std::mutex
+	C API for allocator locks
 */
 
 #ifndef MUTEX_H
@@ -7,16 +7,182 @@
 
 #include <stddef.h>
 
+
+/*
+	Lock implementation (define one, default is futex on Linux)
+*/
+
+// Adaptive futex mutex: spin briefly, then park in the kernel
+//#define MUTEX_FUTEX
+
+// Ticket spinlock (FIFO, spins and then yields, never parks)
+//#define MUTEX_TICKET
+
+// POSIX pthread mutex
+//#define MUTEX_PTHREAD
+
+// std::mutex behind the C boundary
+//#define MUTEX_STD
+
+// No locks at all, the allocator must only be used from one thread
+//#define KMEM_SINGLE_THREAD
+
+#if !defined(KMEM_SINGLE_THREAD) && !defined(MUTEX_FUTEX) && !defined(MUTEX_TICKET) && !defined(MUTEX_PTHREAD) && !defined(MUTEX_STD)
+#ifdef __linux__
+#define MUTEX_FUTEX
+#else
+#define MUTEX_STD
+#endif
+#endif
+
+// Spin iterations before a futex mutex parks or a ticket waiter yields
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 128
+#endif
+
+// Busy-wait hint
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+
+
+
+/*
+	Atomic operations
+*/
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+// The GCC atomic builtins used by the allocator, on the Interlocked intrinsics (x86 and x64)
+// Interlocked calls are full barriers, aligned loads and stores are atomic and ordered by the compiler barrier
+#include <intrin.h>
+
+#define __ATOMIC_RELAXED 0
+#define __ATOMIC_ACQUIRE 2
+#define __ATOMIC_RELEASE 3
+#define __ATOMIC_ACQ_REL 4
+#define __ATOMIC_SEQ_CST 5
+
+#define __atomic_load_n(ptr, order) (_ReadWriteBarrier(), *(ptr))
+#define __atomic_store_n(ptr, value, order) (_ReadWriteBarrier(), *(ptr) = (value), _ReadWriteBarrier())
+#define __atomic_thread_fence(order) _ReadWriteBarrier()
+
+#define __atomic_exchange_n(ptr, value, order) (sizeof(*(ptr)) == 8 ? \
+	_InterlockedExchange64((volatile __int64*)(ptr), (__int64)(value)) : sizeof(*(ptr)) == 4 ? \
+	_InterlockedExchange((volatile long*)(ptr), (long)(value)) : _InterlockedExchange8((volatile char*)(ptr), (char)(value)))
+
+#define __atomic_fetch_add(ptr, value, order) (sizeof(*(ptr)) == 8 ? \
+	_InterlockedExchangeAdd64((volatile __int64*)(ptr), (__int64)(value)) : _InterlockedExchangeAdd((volatile long*)(ptr), (long)(value)))
+
+#define __atomic_fetch_sub(ptr, value, order) __atomic_fetch_add(ptr, -(long long)(value), order)
+
+#define __atomic_compare_exchange_n(ptr, expected, desired, weak, success, failure) \
+	kmem_compare_exchange((ptr), (expected), (unsigned long long)(desired), sizeof(*(ptr)))
+
+// Compare and swap of a 4 or 8 byte value, *expected gets the current value on failure
+static __inline int kmem_compare_exchange(volatile void *ptr, void *expected, unsigned long long desired, size_t size)
+{
+	unsigned long long old, want = size == 8 ? *(unsigned long long*)expected : *(unsigned int*)expected;
+
+	if (size == 8)
+		old = (unsigned long long)_InterlockedCompareExchange64((volatile __int64*)ptr, (__int64)desired, (__int64)want);
+	else
+		old = (unsigned int)_InterlockedCompareExchange((volatile long*)ptr, (long)desired, (long)want);
+
+	if (old == want)
+		return 1;
+
+	if (size == 8)
+		*(unsigned long long*)expected = old;
+	else
+		*(unsigned int*)expected = (unsigned int)old;
+
+	return 0;
+}
+
+#endif
+
+
+
+
+/*
+	Lock storage
+*/
+
+#if defined(KMEM_SINGLE_THREAD)
+
+// Empty, so lock fields and lock slots take no space (GNU C, MSVC needs a member)
+typedef struct kmutex
+{
+#ifdef _MSC_VER
+	char unused;
+#endif
+}kmutex_t;
+
+#elif defined(MUTEX_FUTEX)
+
+// 0 - unlocked, 1 - locked, 2 - locked with waiters
+typedef struct kmutex
+{
+	int state;
+}kmutex_t;
+
+#elif defined(MUTEX_TICKET)
+
+typedef struct kmutex
+{
+	unsigned int next;
+	unsigned int owner;
+}kmutex_t;
+
+#elif defined(MUTEX_PTHREAD)
+
+#include <pthread.h>
+typedef pthread_mutex_t kmutex_t;
+
+#else
+
+// Space for std::mutex (checked in mutex.cpp)
+#ifdef _WIN64
+#define MUTEX_STD_SIZE 80
+#else
+#define MUTEX_STD_SIZE 48
+#endif
+
+typedef union kmutex
+{
+	char space[MUTEX_STD_SIZE];
+	void *align_ptr;
+	long long align_ll;
+}kmutex_t;
+
+#endif
+
 // Mutex type
-typedef void * mutex_t;
+typedef kmutex_t * mutex_t;
 
 // Size of mutex object
-#ifdef _WIN64
-#define MUTEX_SIZE 96
+#define MUTEX_SIZE sizeof(kmutex_t)
+
+
+// Thread-local storage class (plain statics with a single thread)
+#if defined(KMEM_SINGLE_THREAD)
+#define KMEM_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define KMEM_THREAD_LOCAL __declspec(thread)
 #else
-#define MUTEX_SIZE 48
+#define KMEM_THREAD_LOCAL __thread
 #endif
 
+// Thread identity (address of a per-thread anchor)
+typedef size_t thread_id_t;
+#define current_thread() ((thread_id_t)&thread_anchor)
+
 
 
 
@@ -25,18 +191,118 @@ extern "C" {
 
 #endif
 
+// Per-thread anchor for current_thread
+extern KMEM_THREAD_LOCAL char thread_anchor;
+
+#if defined(KMEM_SINGLE_THREAD)
+
+// Locks compile to nothing
+static inline void initMutex(mutex_t sem)
+{
+	(void)sem;
+}
+
+static inline void destroyMutex(mutex_t sem)
+{
+	(void)sem;
+}
+
+static inline void wait(mutex_t sem)
+{
+	(void)sem;
+}
+
+static inline void signal(mutex_t sem)
+{
+	(void)sem;
+}
+
+#else
+
 // Initialize mutex object on allocated space
 void initMutex(mutex_t sem);
 
 // Destroy mutex object
 void destroyMutex(mutex_t sem);
 
+#endif
+
+
+#if defined(MUTEX_FUTEX)
+
+// Contended paths
+void mutex_lock_slow(mutex_t sem);
+void mutex_unlock_slow(mutex_t sem);
+
+// Wait on sem
+static inline void wait(mutex_t sem)
+{
+	int expected = 0;
+
+	if (!__atomic_compare_exchange_n(&sem->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		mutex_lock_slow(sem);
+}
+
+// Signal on sem
+static inline void signal(mutex_t sem)
+{
+	if (__atomic_exchange_n(&sem->state, 0, __ATOMIC_RELEASE) == 2)
+		mutex_unlock_slow(sem);
+}
+
+#elif defined(MUTEX_TICKET)
+
+// Contended path, gives the CPU to other threads
+void mutex_yield(void);
+
+// Wait on sem
+static inline void wait(mutex_t sem)
+{
+	unsigned int ticket = __atomic_fetch_add(&sem->next, 1, __ATOMIC_RELAXED), spins = 0;
+
+	// A preempted holder or earlier ticket only moves on once it runs again
+	while (__atomic_load_n(&sem->owner, __ATOMIC_ACQUIRE) != ticket)
+	{
+		if (spins < MUTEX_SPIN_COUNT)
+		{
+			spins++;
+			cpu_relax();
+		}
+		else
+			mutex_yield();
+	}
+}
+
+// Signal on sem
+static inline void signal(mutex_t sem)
+{
+	__atomic_store_n(&sem->owner, sem->owner + 1, __ATOMIC_RELEASE);
+}
+
+#elif defined(MUTEX_PTHREAD)
+
+// Wait on sem
+static inline void wait(mutex_t sem)
+{
+	pthread_mutex_lock(sem);
+}
+
+// Signal on sem
+static inline void signal(mutex_t sem)
+{
+	pthread_mutex_unlock(sem);
+}
+
+#elif defined(MUTEX_STD)
+
 // Wait on sem
 void wait(mutex_t sem);
 
 // Signal on sem
 void signal(mutex_t sem);
 
+#endif
+
 
 
 #ifdef __cplusplus
@@ -44,4 +310,4 @@ void signal(mutex_t sem);
 #endif
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,206 @@
+/*
+	Typed object cache for C++
+*/
+
+#ifndef OBJECT_CACHE_HPP_
+#define OBJECT_CACHE_HPP_
+
+#include "slab.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <typeinfo>
+#include <utility>
+
+#ifdef __cpp_impl_coroutine
+#include "kmem_async.hpp"
+#endif
+
+// Objects kept per thread before going back to the cache
+#ifndef OBJECT_CACHE_MAGAZINE
+#define OBJECT_CACHE_MAGAZINE 32
+#endif
+
+
+namespace kmem {
+
+	// Number for the next object cache name, one sequence for all types so names never repeat
+	inline unsigned int next_object_cache_id() noexcept
+	{
+		static std::atomic<unsigned int> next_id(0);
+		return next_id++;
+	}
+
+	// Slab cache for objects of type T (kmem_init must be called first)
+	template<class T>
+	class object_cache
+	{
+	public:
+
+		// Object size rounded to the alignment of T
+		static constexpr size_t object_size = (sizeof(T) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+		// Cache shared by all users of T
+		static object_cache &instance()
+		{
+			static object_cache cache;
+			return cache;
+		}
+
+		// Raw storage for one T
+		void *allocate()
+		{
+			magazine &mag = local();
+
+			if (mag.count)
+				return mag.objects[--mag.count];
+
+			return refill(mag);
+		}
+
+		// Return raw storage for one T
+		void deallocate(void *obj)
+		{
+			magazine &mag = local();
+
+			if (mag.count == OBJECT_CACHE_MAGAZINE)
+				flush(mag, OBJECT_CACHE_MAGAZINE / 2);
+
+			mag.objects[mag.count++] = obj;
+		}
+
+#ifdef __cpp_impl_coroutine
+		// Raw storage for one T, co_await waits for a free object instead of failing
+		alloc_awaiter alloc_async()
+		{
+			return alloc_awaiter(cachep);
+		}
+#endif
+
+		// Allocate and construct one T
+		template<class... Args>
+		T *create(Args&&... args)
+		{
+			void *obj = allocate();
+
+			if (obj == nullptr)
+				throw std::bad_alloc();
+
+			try
+			{
+				return new (obj) T(std::forward<Args>(args)...);
+			}
+			catch (...)
+			{
+				deallocate(obj);
+				throw;
+			}
+		}
+
+		// Destruct and free one T
+		void destroy(T *obj)
+		{
+			if (obj == nullptr)
+				return;
+
+			obj->~T();
+			deallocate(obj);
+		}
+
+		// Underlying slab cache
+		kmem_cache_t *cache() const
+		{
+			return cachep;
+		}
+
+	private:
+
+		// Per-thread stack of free objects
+		struct magazine
+		{
+			unsigned int count = 0;
+			void *objects[OBJECT_CACHE_MAGAZINE];
+
+			~magazine()
+			{
+				instance().flush(*this, count);
+			}
+		};
+
+		kmem_cache_t *cachep;
+
+		object_cache()
+		{
+			char name[32];
+
+			std::snprintf(name, sizeof(name), "%.20s#%u", typeid(T).name(), next_object_cache_id());
+			cachep = kmem_cache_create_aligned(name, object_size, alignof(T), nullptr, nullptr);
+
+			if (cachep == nullptr)
+				throw std::bad_alloc();
+		}
+
+		object_cache(const object_cache &) = delete;
+		object_cache &operator=(const object_cache &) = delete;
+
+		static magazine &local()
+		{
+			static thread_local magazine mag;
+			return mag;
+		}
+
+		// Take half a magazine from the cache and hand out one object
+		void *refill(magazine &mag)
+		{
+			void *obj;
+
+			while (mag.count < OBJECT_CACHE_MAGAZINE / 2)
+			{
+				obj = kmem_cache_alloc(cachep);
+
+				if (obj == nullptr)
+					break;
+
+				mag.objects[mag.count++] = obj;
+			}
+
+			return mag.count ? mag.objects[--mag.count] : nullptr;
+		}
+
+		// Give count objects back to the cache
+		void flush(magazine &mag, unsigned int count)
+		{
+			while (count-- && mag.count)
+			{
+				kmem_cache_free(cachep, mag.objects[--mag.count]);
+			}
+		}
+	};
+
+
+	// Deleter for objects created by make
+	template<class T>
+	struct object_deleter
+	{
+		void operator()(T *obj) const
+		{
+			object_cache<T>::instance().destroy(obj);
+		}
+	};
+
+	// Owning handle to a cached object
+	template<class T>
+	using object_ptr = std::unique_ptr<T, object_deleter<T>>;
+
+	// Construct a T in its object cache
+	template<class T, class... Args>
+	object_ptr<T> make(Args&&... args)
+	{
+		return object_ptr<T>(object_cache<T>::instance().create(std::forward<Args>(args)...));
+	}
+
+}
+
+
+#endif //OBJECT_CACHE_HPP_
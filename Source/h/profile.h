@@ -0,0 +1,45 @@
+/*
+	Sampling heap profiler interface
+*/
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stddef.h>
+#include "mutex.h"
+
+// Maximum number of live samples tracked
+#ifndef PROFILE_MAX_SAMPLES
+#define PROFILE_MAX_SAMPLES 4096
+#endif
+
+// Maximum recorded stack depth
+#ifndef PROFILE_MAX_DEPTH
+#define PROFILE_MAX_DEPTH 16
+#endif
+
+// Bytes between checks for a profiler start while sampling is off
+#define PROFILE_IDLE_INTERVAL (1L << 20)
+
+
+// Bytes left until this thread takes the next sample
+extern KMEM_THREAD_LOCAL long profile_countdown;
+
+// Account size allocated bytes, true when obj should be sampled
+#define profile_tick(size) ((profile_countdown -= (long)(size)) < 0)
+
+// Record a stack trace for obj (returns 1 if sampled)
+int profile_sample(const char *cache_name, void *obj, size_t size);
+
+// Forget obj if it was sampled (returns 1 if it was)
+int profile_free(void *obj);
+
+// Forget all samples in [start, end)
+void profile_free_range(void *start, void *end);
+
+// Hold the profiler lock across fork
+void profile_lock(void);
+void profile_unlock(void);
+
+
+#endif //PROFILE_H_
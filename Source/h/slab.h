@@ -10,27 +10,128 @@ typedef struct kmem_cache_s kmem_cache_t;
 #define BLOCK_SIZE  4096
 #define CACHE_L1_LINE_SIZE 64
 
+// Alignment for objects that must not share a cache line
+#define KMEM_ALIGN_L1 CACHE_L1_LINE_SIZE
+
+// Largest size-N buffer, larger kmalloc requests get exact whole blocks
+#define KMALLOC_MAX_ORDER 17
+#define KMALLOC_MAX_SIZE ((size_t)1 << KMALLOC_MAX_ORDER)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Completion of a queued allocation, gets the object (NULL if the cache was destroyed) and the request argument
+typedef void (*kmem_alloc_cb_t)(void *obj, void *arg);
+
+// Object relocation for kmem_cache_defrag, called with the cache locked
+// The callbacks must not allocate from or free to the cache and should only try locks
+typedef struct kmem_reloc_ops
+{
+	// Keep obj from being used or freed while it moves (returns 0 if it can move now)
+	int (*isolate)(void *obj);
+
+	// Copy obj into new_obj (NULL copies the bytes)
+	void (*move)(void *obj, void *new_obj);
+
+	// Point every reference to obj at new_obj and end the isolation, obj is freed afterwards
+	void (*update)(void *obj, void *new_obj);
+}kmem_reloc_ops_t;
+
+// Queued allocation request, the caller keeps it alive until the callback runs or it is cancelled
+typedef struct kmem_waiter
+{
+	kmem_alloc_cb_t callback;
+	void *arg;
+	void *obj;
+	kmem_cache_t *cache;
+	struct kmem_waiter *next;
+}kmem_waiter_t;
+
 // Initialize allocator
-void kmem_init(void *space, int block_num);
+// Its block map (8 bytes per block) is mapped apart from space and gets memory only where blocks are used
+void kmem_init(void *space, size_t block_num);
+
+// Initialize allocator in zero filled memory, such as a fresh mapping (zeroed allocations skip clearing it)
+void kmem_init_zeroed(void *space, size_t block_num);
+
+// Initialize allocator in a new file of size bytes mapped into memory (returns 0 on success)
+int kmem_init_file(const char *path, size_t size);
+
+// Map a heap file made by kmem_init_file and resume its caches instead of kmem_init (returns 0 on success)
+// Cache handles are looked up again with kmem_cache_create, which also restores constructors
+// The file stays locked while the heap is in use, a file held by another process is refused
+// The current heap is given up first: workers stop and a heap file is unmapped and unlocked
+int kmem_attach(const char *path);
 
 // Allocate cache
 kmem_cache_t *kmem_cache_create(const char *name, size_t size, void(*ctor)(void *),void(*dtor)(void *)); 
 
+// Allocate cache with objects aligned to align (power of two, 0 for default)
+kmem_cache_t *kmem_cache_create_aligned(const char *name, size_t size, size_t align, void(*ctor)(void *), void(*dtor)(void *)); 
+
+// Allocate cache whose objects kmem_cache_defrag may move (never merged with other caches)
+kmem_cache_t *kmem_cache_create_movable(const char *name, size_t size, size_t align, void(*ctor)(void *), void(*dtor)(void *), const kmem_reloc_ops_t *reloc); 
+
 // Shrink cache
 int kmem_cache_shrink(kmem_cache_t *cachep); 
 
+// Move objects out of slabs less than target_occupancy percent full into fuller slabs and free the emptied slabs
+// Returns the number of blocks given back (only movable caches are compacted)
+int kmem_cache_defrag(kmem_cache_t *cachep, unsigned int target_occupancy); 
+
+// Grow cache ahead of time until min_objects objects are free (returns 0 on success)
+int kmem_cache_reserve(kmem_cache_t *cachep, unsigned int min_objects); 
+
+// Set the number of free objects kept when the cache shrinks
+void kmem_cache_set_min_free(kmem_cache_t *cachep, unsigned int min_free); 
+
+// Let the refill worker keep at least low_watermark objects free (0 - off)
+void kmem_cache_set_low_watermark(kmem_cache_t *cachep, unsigned int low_watermark); 
+
+// Start a background thread that grows caches below their low watermark, checking at least every period_ms
+int kmem_refill_start(unsigned int period_ms); 
+
+// Stop the refill thread
+void kmem_refill_stop(void); 
+
 // Allocate one object from cache
 void *kmem_cache_alloc(kmem_cache_t *cachep); 
 
+// Allocate one object from cache, trying the slab holding hint and then slabs in the blocks around it
+void *kmem_cache_alloc_near(kmem_cache_t *cachep, const void *hint); 
+
+// Allocate one zero filled object from cache
+void *kmem_cache_zalloc(kmem_cache_t *cachep); 
+
+// Allocate one object from cache into *objp, or queue waiter if the cache and the buddy pool are exhausted
+// Returns 0 when *objp is set, 1 when queued (callback then runs on the thread whose free satisfies the request, FIFO per cache), -1 on error
+int kmem_cache_alloc_async(kmem_cache_t *cachep, kmem_waiter_t *waiter, kmem_alloc_cb_t callback, void *arg, void **objp); 
+
+// Remove a queued request (returns 1 if it was still queued, 0 if its callback has run or is running)
+int kmem_cache_alloc_cancel(kmem_cache_t *cachep, kmem_waiter_t *waiter); 
+
 // Deallocate one object from cache
 void kmem_cache_free(kmem_cache_t *cachep, void *objp); 
 
-// Alloacate one small memory buffer
+// Alloacate one memory buffer
 void *kmalloc(size_t size); 
 
-// Deallocate one small memory buffer
+// Allocate one zero filled memory buffer
+void *kzalloc(size_t size); 
+
+// Allocate one small memory buffer aligned to align (power of two)
+void *kmalloc_aligned(size_t size, size_t align); 
+
+// Deallocate one memory buffer
 void kfree(const void *objp); 
 
+// Deallocate one memory buffer of known size
+void kfree_sized(const void *objp, size_t size); 
+
+// Usable size of a memory buffer (0 if objp is not from kmalloc)
+size_t ksize(const void *objp); 
+
 // Deallocate cache
 void kmem_cache_destroy(kmem_cache_t *cachep); 
 
@@ -40,4 +141,28 @@ void kmem_cache_info(kmem_cache_t *cachep);
 // Print error message
 int kmem_cache_error(kmem_cache_t *cachep); 
 
+// Sample about one allocation per sample_bytes allocated bytes (0 stops)
+void kmem_profile_start(size_t sample_bytes); 
+
+// Write live sampled allocations by stack and cache to a file
+int kmem_profile_dump(const char *path); 
+
+// Publish allocator counters in the shared memory object name (such as "/kmem.1234"), refreshed every period_ms (0 - only on kmem_telemetry_publish)
+int kmem_telemetry_start(const char *name, unsigned int period_ms); 
+
+// Refresh the published counters now
+void kmem_telemetry_publish(void); 
+
+// Stop publishing and remove the shared memory object
+void kmem_telemetry_stop(void); 
+
+// Handlers for pthread_atfork, so a child forked while other threads allocate gets a usable heap
+void kmem_fork_prepare(void); 
+void kmem_fork_parent(void); 
+void kmem_fork_child(void); 
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif //SLAB_H_
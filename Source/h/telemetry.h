@@ -0,0 +1,64 @@
+/*
+	Shared memory telemetry layout
+*/
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+
+// Marks a telemetry segment
+#define TELEMETRY_MAGIC 0x6b6d7473
+
+// Layout version, bumped when the structures below change
+#define TELEMETRY_VERSION 1
+
+// Caches published, later ones are counted in dropped_caches
+#ifndef TELEMETRY_MAX_CACHES
+#define TELEMETRY_MAX_CACHES 256
+#endif
+
+// Buddy orders published
+#define TELEMETRY_MAX_ORDERS 40
+
+// Cache name length in the segment
+#define TELEMETRY_NAME_LEN 32
+
+
+// Counters of one cache
+typedef struct kmem_telemetry_cache
+{
+	char name[TELEMETRY_NAME_LEN];
+	uint64_t object_size;
+	uint64_t slab_blocks;
+	uint64_t obj_per_slab;
+	uint64_t slabs;
+	uint64_t empty_slabs;
+	uint64_t free_objects;
+	uint64_t allocs;
+	uint64_t frees;
+}kmem_telemetry_cache_t;
+
+
+// Telemetry segment
+// The publisher makes seq odd while it writes the rest, a reader copies the segment and retries if seq was odd or changed
+typedef struct kmem_telemetry
+{
+	uint32_t seq;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cache_count;
+
+	uint64_t timestamp_ns;
+	uint64_t block_size;
+	uint64_t total_blocks;
+	uint64_t free_blocks;
+	uint64_t dropped_caches;
+
+	uint64_t free_chunks[TELEMETRY_MAX_ORDERS];
+
+	kmem_telemetry_cache_t caches[TELEMETRY_MAX_CACHES];
+}kmem_telemetry_t;
+
+
+#endif //TELEMETRY_H_
@@ -0,0 +1,28 @@
+/*
+	Static tracepoints (USDT) for perf and bpftrace
+*/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// Compile the tracepoints out
+//#define KMEM_NO_TRACE
+
+#if !defined(KMEM_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define KMEM_TRACE_ENABLED
+#endif
+#endif
+
+
+// Tracepoint kmem:name with 1 to 6 arguments
+// A probe is a single nop and a note in the binary until a tracer attaches, so arguments should be values at hand
+#ifdef KMEM_TRACE_ENABLED
+#define kmem_trace(name, ...) STAP_PROBEV(kmem, name, __VA_ARGS__)
+#else
+#define kmem_trace(name, ...) ((void)0)
+#endif
+
+
+#endif //TRACE_H_
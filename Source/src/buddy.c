@@ -3,6 +3,21 @@
 */
 
 #include "buddy.h"
+#include "trace.h"
+
+
+
+
+
+/*
+	Buddy parameters
+*/
+
+// Keep freed blocks on per-order lists and coalesce them later
+//#define BUDDY_LAZY
+
+// Freed blocks of one order kept before they are coalesced
+#define BUDDY_LAZY_LIMIT 8
 
 
 
@@ -28,6 +43,11 @@ typedef struct buddy_struct
 	block_count_t alloc_block_count;
 	block_count_t free_block_count;
 	block_index_t free_heads[MAX_ORDER_LIMIT];
+	block_count_t free_count[MAX_ORDER_LIMIT];
+#ifdef BUDDY_LAZY
+	block_index_t lazy_heads[MAX_ORDER_LIMIT];
+	unsigned int lazy_count[MAX_ORDER_LIMIT];
+#endif
 	unsigned int max_order;
 	unsigned int ctrl_offset;
 }buddy_struct_t;
@@ -43,8 +63,12 @@ typedef struct buddy_struct
 #define get_block(block_index) (block_t)((char*)(mem_space) + BLOCK_SIZE*block_index)
 #define get_index(block_ptr) (block_index_t)((char*)block_ptr - (char*)mem_space)/BLOCK_SIZE;
 #define get_next_index(block_ptr) (block_index_t)(*(block_index_t*)block_ptr)
-#define set_next_index(cur_block_ptr, next_block_index) (block_index_t)(*(block_index_t*)cur_block_ptr) = next_block_index
-#define null_next_index(block_ptr)  (block_index_t)(*(block_index_t*)block_ptr) = NULL_INDEX
+#define set_next_index(cur_block_ptr, next_block_index) (*(block_index_t*)cur_block_ptr) = next_block_index
+#define null_next_index(block_ptr)  (*(block_index_t*)block_ptr) = NULL_INDEX
+
+// Free blocks keep a known-zero flag after the next index (cleared again on allocation)
+#define get_zero_flag(block_ptr) (char)(((block_index_t*)(block_ptr))[1])
+#define set_zero_flag(block_ptr, zero) (((block_index_t*)(block_ptr))[1]) = (block_index_t)(zero)
 
 
 
@@ -68,7 +92,7 @@ buddy_struct_t *buddy_ctrl_struct;
 */
 
 // Calculates maximum order of two found in num
-unsigned int calc_max_order(unsigned int num)
+unsigned int calc_max_order(block_count_t num)
 {
 	int m = -1;
 	while (num)
@@ -97,13 +121,14 @@ unsigned int calc_block_order(size_t size)
 // Calculates index of buddy block
 block_index_t calc_buddy_index(block_index_t block_index, unsigned int order)
 {
-	char left, sign;
+	char left;
 	if (block_index % power_of_two(order) != 1 && order != 0)
 		return NULL_INDEX;
 
 	left = (block_index % power_of_two(order + 1)) == 1;
-	sign = -1 * (!left) + left;
-	return block_index + sign*power_of_two(order);
+
+	// Unsigned offset, so step down explicitly for a right buddy
+	return left ? block_index + power_of_two(order) : block_index - power_of_two(order);
 }
 
 
@@ -115,13 +140,15 @@ block_index_t calc_buddy_index(block_index_t block_index, unsigned int order)
 	List operations
 */
 
-void put_first(block_index_t block_index, unsigned int order)
+void put_first(block_index_t block_index, unsigned int order, char zero)
 {
 	block_index_t head_index;
 
 	head_index = buddy_ctrl_struct->free_heads[order]; 
 	set_next_index(get_block(block_index), head_index);
+	set_zero_flag(get_block(block_index), zero);
 	buddy_ctrl_struct->free_heads[order] = block_index;
+	buddy_ctrl_struct->free_count[order]++;
 }
 
 
@@ -155,6 +182,7 @@ block_index_t remove(block_index_t block_index, unsigned int order)
 	}
 
 	null_next_index(get_block(cur));
+	buddy_ctrl_struct->free_count[order]--;
 	return cur;
 }
 
@@ -166,8 +194,8 @@ block_index_t remove(block_index_t block_index, unsigned int order)
 	Buddy allocator functions	
 */
 
-// Initialize buddy allocator
-int buddy_init(void* space, block_count_t block_count)
+// Initialize buddy allocator (zero - space is known to be zero filled)
+int buddy_init_space(void* space, block_count_t block_count, char zero)
 {
 
 	int order;
@@ -179,6 +207,10 @@ int buddy_init(void* space, block_count_t block_count)
 
 	block_count--;
 	order = calc_max_order(block_count);
+
+	if (block_count == 0 || order >= MAX_ORDER_LIMIT)
+		return -1;
+
 	buddy_ctrl_struct->max_order = (unsigned int)order;
 
 	buddy_ctrl_struct->alloc_block_count = block_count;
@@ -193,13 +225,20 @@ int buddy_init(void* space, block_count_t block_count)
 		if (block_count & power_of_two(order))
 		{
 			buddy_ctrl_struct->free_heads[order] = block_index;
+			buddy_ctrl_struct->free_count[order] = 1;
 			null_next_index(get_block(block_index));
+			set_zero_flag(get_block(block_index), zero);
 			block_index += power_of_two(order);
 		}
 		else
 		{
 			buddy_ctrl_struct->free_heads[order] = NULL_INDEX;
+			buddy_ctrl_struct->free_count[order] = 0;
 		}
+#ifdef BUDDY_LAZY
+		buddy_ctrl_struct->lazy_heads[order] = NULL_INDEX;
+		buddy_ctrl_struct->lazy_count[order] = 0;
+#endif
 		order--;
 	}
 
@@ -207,56 +246,189 @@ int buddy_init(void* space, block_count_t block_count)
 }
 
 
+// Initialize buddy allocator
+int buddy_init(void* space, block_count_t block_count)
+{
+	return buddy_init_space(space, block_count, 0);
+}
+
+
+// Initialize buddy allocator in zero filled space (fresh mappings)
+int buddy_init_zeroed(void* space, block_count_t block_count)
+{
+	return buddy_init_space(space, block_count, 1);
+}
+
+
+// Resume a buddy allocator initialized earlier in space (possibly at another address)
+int buddy_attach(void* space)
+{
+	mem_space = space;
+
+	buddy_ctrl_struct = (buddy_struct_t*)mem_space;
+
+	// Free lists hold block indexes, only the cached pointer moves
+	buddy_ctrl_struct->alloc_space = (void*)((char*)mem_space + BLOCK_SIZE*FIRST_ALLOC_INDEX);
+
+	return 0;
+}
+
+
+// Smallest order from order up with a free block (max_order + 1 if none)
+unsigned int find_free_order(unsigned int order)
+{
+	while (order <= buddy_ctrl_struct->max_order && buddy_ctrl_struct->free_heads[order] == NULL_INDEX)
+		order++;
+
+	return order;
+}
+
+
+// Merge a free block with its free buddies and put it on its list
+void coalesce(block_index_t index, unsigned int order)
+{
+	block_index_t buddy_index = calc_buddy_index(index,order);
+
+	buddy_index = remove(buddy_index, order);
+
+	while (buddy_index != NULL_INDEX)
+	{
+		if (buddy_index < index)
+			index = buddy_index;
+
+		order++;
+
+		kmem_trace(buddy_merge, index, order);
+
+		buddy_index = calc_buddy_index(index, order);
+		buddy_index = remove(buddy_index, order);
+	}
+
+	put_first(index, order, 0);
+}
+
+
+#ifdef BUDDY_LAZY
+
+// Take the most recently freed block of an order
+block_index_t lazy_pop(unsigned int order)
+{
+	block_index_t index = buddy_ctrl_struct->lazy_heads[order];
+
+	if (index != NULL_INDEX)
+	{
+		buddy_ctrl_struct->lazy_heads[order] = get_next_index(get_block(index));
+		buddy_ctrl_struct->lazy_count[order]--;
+		null_next_index(get_block(index));
+	}
+
+	return index;
+}
+
+
+// Coalesce all deferred blocks of an order
+void lazy_flush(unsigned int order)
+{
+	block_index_t index;
+
+	while ((index = lazy_pop(order)) != NULL_INDEX)
+		coalesce(index, order);
+}
+
+
+// Coalesce all deferred blocks
+void lazy_flush_all(void)
+{
+	unsigned int order;
+
+	for (order = 0; order <= buddy_ctrl_struct->max_order; order++)
+		lazy_flush(order);
+}
+
+
+// Defer coalescing of a freed block until its order has too many
+void lazy_push(block_index_t index, unsigned int order)
+{
+	set_next_index(get_block(index), buddy_ctrl_struct->lazy_heads[order]);
+	set_zero_flag(get_block(index), 0);
+	buddy_ctrl_struct->lazy_heads[order] = index;
+
+	if (++(buddy_ctrl_struct->lazy_count[order]) > BUDDY_LAZY_LIMIT)
+		lazy_flush(order);
+}
+
+#endif
+
+
 // Allocate blocks
 block_area_t buddy_alloc(unsigned int order)
 {
-	block_index_t head_index,temp_index,buddy_index;
+	block_index_t temp_index = NULL_INDEX, buddy_index;
 	block_t free_block = NULL;
 	block_count_t block_count = power_of_two(order);
 	block_area_t ret;
 	unsigned int temp_order;
+	char zero = 0;
 
 
 	if (buddy_ctrl_struct->free_block_count >= block_count && order <= buddy_ctrl_struct->max_order)
 	{
-		head_index = buddy_ctrl_struct->free_heads[order];
+#ifdef BUDDY_LAZY
+		// A block freed recently at this order is reused without a split
+		temp_index = lazy_pop(order);
+#endif
 
-		if (head_index != NULL_INDEX)
-		{
-			temp_index = remove(head_index, order);
-		}
-		else
+		if (temp_index == NULL_INDEX)
 		{
-			temp_order = order;
-
-			while (buddy_ctrl_struct->free_heads[temp_order] == NULL_INDEX)
-				temp_order++;
-
-			head_index = buddy_ctrl_struct->free_heads[temp_order];
-
-			temp_index = remove(head_index, temp_order);
+			temp_order = find_free_order(order);
 
+#ifdef BUDDY_LAZY
+			// Coalescing the deferred blocks may make a large enough one
+			if (temp_order > buddy_ctrl_struct->max_order)
+			{
+				lazy_flush_all();
+				temp_order = find_free_order(order);
+			}
+#endif
 
-			while (temp_order != order)
+			if (temp_order <= buddy_ctrl_struct->max_order)
 			{
-				buddy_index = temp_index + power_of_two(temp_order-1);
-				
-				put_first(buddy_index,temp_order-1);
-				temp_order--;
+				temp_index = remove(buddy_ctrl_struct->free_heads[temp_order], temp_order);
+				zero = get_zero_flag(get_block(temp_index));
+
+				while (temp_order != order)
+				{
+					buddy_index = temp_index + power_of_two(temp_order-1);
+					
+					put_first(buddy_index,temp_order-1,zero);
+					temp_order--;
+
+					kmem_trace(buddy_split, temp_index, temp_order);
+				}
 			}
 		}
+	}
 
+	if (temp_index != NULL_INDEX)
+	{
 		free_block = get_block(temp_index);
+
+		// The next index is already NULL_INDEX, clearing the flag leaves a zero block zero
+		zero = get_zero_flag(free_block);
+		set_zero_flag(free_block, 0);
+
 		buddy_ctrl_struct->free_block_count -= block_count;
+
+		kmem_trace(buddy_alloc, temp_index, order);
 	}
 	else
 	{
-		free_block = NULL;
-		temp_index = NULL_INDEX;
+		kmem_trace(buddy_alloc_fail, order, buddy_ctrl_struct->free_block_count);
 	}
 	
 	ret.addr = free_block;
 	ret.order = order;
+	ret.zero = zero;
 	
 	return ret;
 }
@@ -268,25 +440,17 @@ int buddy_free(block_area_t *block_area)
 
 	block_index_t index = get_index(block_area->addr);
 	unsigned int order = block_area->order;
-	block_index_t buddy_index = calc_buddy_index(index,order);
 	block_count_t block_count = power_of_two(order);
 
 	if (index > NULL_INDEX && index <= buddy_ctrl_struct->alloc_block_count)
 	{
-		buddy_index = remove(buddy_index, order);
-
-		while (buddy_index != NULL_INDEX)
-		{
-			if (buddy_index < index)
-				index = buddy_index;
+		kmem_trace(buddy_free, index, order);
 
-			order++;
-
-			buddy_index = calc_buddy_index(index, order);
-			buddy_index = remove(buddy_index, order);
-		}
-
-		put_first(index, order);
+#ifdef BUDDY_LAZY
+		lazy_push(index, order);
+#else
+		coalesce(index, order);
+#endif
 
 		buddy_ctrl_struct->free_block_count += block_count;
 	}
@@ -299,6 +463,76 @@ int buddy_free(block_area_t *block_area)
 }
 
 
+// Largest aligned chunk starting at offset pos that ends by limit
+unsigned int calc_chunk_order(block_count_t pos, block_count_t limit)
+{
+	unsigned int order = 0;
+
+	while ((pos & power_of_two(order)) == 0 && pos + power_of_two(order + 1) <= limit)
+		order++;
+
+	return order;
+}
+
+
+// Allocate exactly count blocks (the rest of the rounded block goes back)
+void *buddy_alloc_blocks(block_count_t count, char *zero)
+{
+	block_area_t area;
+	block_index_t index;
+	block_count_t pos, total;
+	unsigned int order;
+
+	if (count == 0)
+		return NULL;
+
+	order = calc_max_order(count);
+	if (power_of_two(order) < count)
+		order++;
+
+	area = buddy_alloc(order);
+
+	if (area.addr == NULL)
+		return NULL;
+
+	index = get_index(area.addr);
+	total = power_of_two(area.order);
+
+	// The block's buddy is in use, so the tail chunks cannot merge
+	for (pos = count; pos < total; pos += power_of_two(order))
+	{
+		order = calc_chunk_order(pos, total);
+		put_first(index + pos, order, area.zero);
+	}
+
+	buddy_ctrl_struct->free_block_count += total - count;
+
+	if (zero)
+		*zero = area.zero;
+
+	return area.addr;
+}
+
+
+// Free count blocks as aligned power-of-two chunks
+int buddy_free_blocks(void *addr, block_count_t count)
+{
+	block_area_t area;
+	block_count_t pos;
+
+	for (pos = 0; pos < count; pos += power_of_two(area.order))
+	{
+		area.addr = (char*)addr + size_in_bytes(pos);
+		area.order = calc_chunk_order(pos, count);
+
+		if (buddy_free(&area) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
 // Allocate kernel control space
 void *kernel_ctrl_alloc(size_t size)
 {
@@ -311,4 +545,55 @@ void *kernel_ctrl_alloc(size_t size)
 	buddy_ctrl_struct->ctrl_offset += size_in_L1(size)*CACHE_L1_LINE_SIZE;
 
 	return mem;
-}
\ No newline at end of file
+}
+
+
+// First kernel control allocation
+void *kernel_ctrl_first(void)
+{
+	return (void*)((char*)mem_space + size_in_L1(sizeof(buddy_struct_t))*CACHE_L1_LINE_SIZE);
+}
+
+
+// Number of blocks managed
+block_count_t buddy_block_count(void)
+{
+	return buddy_ctrl_struct->alloc_block_count + FIRST_ALLOC_INDEX;
+}
+
+
+// Free blocks
+block_count_t buddy_free_block_count(void)
+{
+	return buddy_ctrl_struct->free_block_count;
+}
+
+
+// Free chunks of 2^order blocks (deferred ones included)
+block_count_t buddy_free_chunks(unsigned int order)
+{
+	block_count_t count;
+
+	if (order > buddy_ctrl_struct->max_order)
+		return 0;
+
+	count = buddy_ctrl_struct->free_count[order];
+#ifdef BUDDY_LAZY
+	count += buddy_ctrl_struct->lazy_count[order];
+#endif
+
+	return count;
+}
+
+
+// Index of the block containing addr
+block_index_t buddy_index_of(void *addr)
+{
+	return (block_index_t)(((char*)addr - (char*)mem_space) / BLOCK_SIZE);
+}
+
+// Address of block index
+void *buddy_block_addr(block_index_t index)
+{
+	return (char*)mem_space + size_in_bytes(index);
+}
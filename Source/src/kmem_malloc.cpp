@@ -0,0 +1,419 @@
+/*
+	malloc/free and operator new/delete on top of kmalloc
+
+	Build the sources with -fPIC -DKMEM_SILENT into a shared library and
+	load it with LD_PRELOAD to run unmodified programs on this allocator.
+	The heap is reserved on the first call. KMEM_ARENA_MB sets its size.
+*/
+
+#include "slab.h"
+#include "mutex.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+// Default heap size in megabytes
+#ifndef KMEM_ARENA_MB
+#define KMEM_ARENA_MB 1024
+#endif
+
+#define KMEM_EXPORT extern "C" __attribute__((visibility("default")))
+
+
+// Heap state: 0 - not mapped, 1 - being set up, 2 - ready, 3 - failed
+static atomic<int> arena_state(0);
+
+// Heap range, pointers outside it are not ours
+static char *arena_start;
+static char *arena_end;
+
+
+// Map and initialize the heap on the first allocation
+static bool arena_init()
+{
+	const char *env;
+	size_t size;
+	void *space;
+	int expected = 0;
+
+	if (arena_state.compare_exchange_strong(expected, 1, memory_order_acquire))
+	{
+		env = getenv("KMEM_ARENA_MB");
+		size = (size_t)(env && atoi(env) > 0 ? atoi(env) : KMEM_ARENA_MB) << 20;
+
+		// Untouched blocks stay unbacked
+		space = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		if (space == MAP_FAILED)
+		{
+			arena_state.store(3, memory_order_release);
+			return false;
+		}
+
+		kmem_init_zeroed(space, size / BLOCK_SIZE);
+
+		// A thread holding an allocator lock during fork would leave it locked in the child
+		pthread_atfork(kmem_fork_prepare, kmem_fork_parent, kmem_fork_child);
+
+		arena_start = (char*)space;
+		arena_end = arena_start + size;
+
+		arena_state.store(2, memory_order_release);
+		return true;
+	}
+
+	while ((expected = arena_state.load(memory_order_acquire)) == 1)
+		cpu_relax();
+
+	return expected == 2;
+}
+
+
+// Heap is usable
+static inline bool arena_ready()
+{
+	return arena_state.load(memory_order_acquire) == 2 || arena_init();
+}
+
+
+// Pointer belongs to the heap
+static inline bool arena_owns(const void *ptr)
+{
+	return (const char*)ptr >= arena_start && (const char*)ptr < arena_end;
+}
+
+
+// Allocate size bytes (never 0)
+static void *arena_alloc(size_t size)
+{
+	void *mem;
+
+	if (!arena_ready())
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	mem = kmalloc(size ? size : 1);
+
+	if (mem == NULL)
+		errno = ENOMEM;
+
+	return mem;
+}
+
+
+// Allocate size bytes aligned to align (power of two)
+static void *arena_alloc_aligned(size_t size, size_t align)
+{
+	void *mem;
+
+	if (!arena_ready())
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	mem = kmalloc_aligned(size ? size : 1, align < sizeof(void*) ? sizeof(void*) : align);
+
+	if (mem == NULL)
+		errno = ENOMEM;
+
+	return mem;
+}
+
+
+// Free mem (foreign pointers are left alone)
+static inline void arena_free(void *mem)
+{
+	if (mem && arena_owns(mem))
+		kfree(mem);
+}
+
+
+// Free mem allocated by arena_alloc(size)
+static inline void arena_free_sized(void *mem, size_t size)
+{
+	if (mem && arena_owns(mem))
+		kfree_sized(mem, size ? size : 1);
+}
+
+
+// realloc of the next library, for blocks allocated before the heap took over
+static void *foreign_realloc(void *mem, size_t size)
+{
+	typedef void *(*realloc_t)(void*, size_t);
+	static atomic<realloc_t> next_realloc(nullptr);
+	realloc_t next = next_realloc.load(memory_order_acquire);
+
+	if (next == nullptr)
+	{
+		next = (realloc_t)dlsym(RTLD_NEXT, "realloc");
+		next_realloc.store(next, memory_order_release);
+	}
+
+	if (next == nullptr)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return next(mem, size);
+}
+
+
+// Allocation for operator new (calls the new handler until it succeeds)
+static void *arena_new(size_t size, size_t align)
+{
+	void *mem;
+	new_handler handler;
+
+	for (;;)
+	{
+		mem = align ? arena_alloc_aligned(size, align) : arena_alloc(size);
+
+		if (mem)
+			return mem;
+
+		handler = get_new_handler();
+
+		if (handler == nullptr)
+			throw bad_alloc();
+
+		handler();
+	}
+}
+
+
+
+
+/*
+	C allocation functions
+*/
+
+KMEM_EXPORT void *malloc(size_t size)
+{
+	return arena_alloc(size);
+}
+
+KMEM_EXPORT void free(void *mem)
+{
+	arena_free(mem);
+}
+
+KMEM_EXPORT void *calloc(size_t count, size_t size)
+{
+	void *mem;
+
+	if (size && count > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (!arena_ready())
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Skips clearing memory that was never used
+	mem = kzalloc(count * size != 0 ? count * size : 1);
+
+	if (mem == NULL)
+		errno = ENOMEM;
+
+	return mem;
+}
+
+KMEM_EXPORT void *realloc(void *mem, size_t size)
+{
+	void *moved;
+	size_t usable;
+
+	if (mem == NULL)
+		return arena_alloc(size);
+
+	// Its size is only known to the allocator that made it
+	if (!arena_owns(mem))
+		return foreign_realloc(mem, size);
+
+	if (size == 0)
+	{
+		arena_free(mem);
+		return NULL;
+	}
+
+	usable = ksize(mem);
+
+	if (size <= usable)
+		return mem;
+
+	moved = arena_alloc(size);
+
+	if (moved)
+	{
+		memcpy(moved, mem, usable);
+		arena_free(mem);
+	}
+
+	return moved;
+}
+
+KMEM_EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *mem;
+
+	if (align == 0 || (align & (align - 1)) || align % sizeof(void*))
+		return EINVAL;
+
+	mem = arena_alloc_aligned(size, align);
+
+	if (mem == NULL)
+		return ENOMEM;
+
+	*memptr = mem;
+	return 0;
+}
+
+KMEM_EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+	if (align == 0 || (align & (align - 1)))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return arena_alloc_aligned(size, align);
+}
+
+KMEM_EXPORT void *memalign(size_t align, size_t size)
+{
+	return aligned_alloc(align, size);
+}
+
+KMEM_EXPORT void *valloc(size_t size)
+{
+	return arena_alloc_aligned(size, BLOCK_SIZE);
+}
+
+KMEM_EXPORT size_t malloc_usable_size(void *mem)
+{
+	return mem && arena_owns(mem) ? ksize(mem) : 0;
+}
+
+
+
+
+/*
+	C++ allocation functions
+*/
+
+void *operator new(size_t size)
+{
+	return arena_new(size, 0);
+}
+
+void *operator new[](size_t size)
+{
+	return arena_new(size, 0);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+	return arena_alloc(size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+	return arena_alloc(size);
+}
+
+void *operator new(size_t size, align_val_t align)
+{
+	return arena_new(size, (size_t)align);
+}
+
+void *operator new[](size_t size, align_val_t align)
+{
+	return arena_new(size, (size_t)align);
+}
+
+void *operator new(size_t size, align_val_t align, const nothrow_t &) noexcept
+{
+	return arena_alloc_aligned(size, (size_t)align);
+}
+
+void *operator new[](size_t size, align_val_t align, const nothrow_t &) noexcept
+{
+	return arena_alloc_aligned(size, (size_t)align);
+}
+
+void operator delete(void *mem) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete[](void *mem) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete(void *mem, const nothrow_t &) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete[](void *mem, const nothrow_t &) noexcept
+{
+	arena_free(mem);
+}
+
+// Sized delete takes the buffer's size class from the size and reads only the slab entry of the block map
+void operator delete(void *mem, size_t size) noexcept
+{
+	arena_free_sized(mem, size);
+}
+
+void operator delete[](void *mem, size_t size) noexcept
+{
+	arena_free_sized(mem, size);
+}
+
+void operator delete(void *mem, align_val_t) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete[](void *mem, align_val_t) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete(void *mem, size_t, align_val_t) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete[](void *mem, size_t, align_val_t) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete(void *mem, align_val_t, const nothrow_t &) noexcept
+{
+	arena_free(mem);
+}
+
+void operator delete[](void *mem, align_val_t, const nothrow_t &) noexcept
+{
+	arena_free(mem);
+}
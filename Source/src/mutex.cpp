@@ -1,23 +1,128 @@
 /*
-	std::mutex implementation for C
+	Lock implementations for C
 */
 
 #include "mutex.h"
-#include <mutex>
+#include "trace.h"
 #include <cstdlib>
+
+#if defined(KMEM_SINGLE_THREAD)
+#elif defined(MUTEX_FUTEX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(MUTEX_TICKET)
+#include <thread>
+#elif defined(MUTEX_STD)
+#include <mutex>
+#include <new>
+#endif
+
 using namespace std;
 
 extern "C" {
 
+	KMEM_THREAD_LOCAL char thread_anchor;
+
+#if defined(KMEM_SINGLE_THREAD)
+
+	// Locks are empty inline functions in mutex.h
+
+#elif defined(MUTEX_FUTEX)
+
+	static long futex(int *addr, int op, int val)
+	{
+		return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+	}
+
+	void initMutex(mutex_t s)
+	{
+		s->state = 0;
+	}
+
+	void destroyMutex(mutex_t s)
+	{
+		(void)s;
+	}
+
+	void mutex_lock_slow(mutex_t s)
+	{
+		int i, c;
+
+		// Short critical sections usually end while we spin
+		for (i = 0; i < MUTEX_SPIN_COUNT; i++)
+		{
+			c = 0;
+			if (__atomic_load_n(&s->state, __ATOMIC_RELAXED) == 0 &&
+				__atomic_compare_exchange_n(&s->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			cpu_relax();
+		}
+
+		// Park, marking the lock as contended
+		c = __atomic_exchange_n(&s->state, 2, __ATOMIC_ACQUIRE);
+		if (c == 0)
+			return;
+
+		kmem_trace(lock_contended, s);
+
+		while (c != 0)
+		{
+			futex(&s->state, FUTEX_WAIT_PRIVATE, 2);
+			c = __atomic_exchange_n(&s->state, 2, __ATOMIC_ACQUIRE);
+		}
+
+		kmem_trace(lock_acquired, s);
+	}
+
+	void mutex_unlock_slow(mutex_t s)
+	{
+		futex(&s->state, FUTEX_WAKE_PRIVATE, 1);
+	}
+
+#elif defined(MUTEX_TICKET)
+
+	void initMutex(mutex_t s)
+	{
+		s->next = 0;
+		s->owner = 0;
+	}
+
+	void destroyMutex(mutex_t s)
+	{
+		(void)s;
+	}
+
+	void mutex_yield(void)
+	{
+		this_thread::yield();
+	}
+
+#elif defined(MUTEX_PTHREAD)
+
+	void initMutex(mutex_t s)
+	{
+		pthread_mutex_init(s, NULL);
+	}
+
+	void destroyMutex(mutex_t s)
+	{
+		pthread_mutex_destroy(s);
+	}
+
+#else
+
+	static_assert(sizeof(mutex) <= sizeof(kmutex_t), "MUTEX_STD_SIZE too small for std::mutex");
+	static_assert(alignof(mutex) <= alignof(kmutex_t), "kmutex_t alignment too small for std::mutex");
+
 	void initMutex(mutex_t s)
 	{
-		mutex m;
-		memcpy(s, &m, sizeof(m));
+		new (s) mutex();
 	}
 
 	void destroyMutex(mutex_t s)
 	{
-		delete ((mutex*)s);
+		((mutex*)s)->~mutex();
 	}
 
 	void wait(mutex_t s)
@@ -30,6 +135,6 @@ extern "C" {
 		((mutex*)s)->unlock();
 	}
 
-}
-
+#endif
 
+}
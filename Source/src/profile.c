@@ -0,0 +1,344 @@
+/*
+	Sampling heap profiler implementation
+*/
+
+#include "profile.h"
+#include "slab.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// Stack walker (glibc and macOS), elsewhere samples have no stack
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#else
+#define backtrace(stack, size) ((void)(stack), 0)
+#define backtrace_symbols_fd(stack, depth, fd) ((void)0)
+#endif
+
+
+
+/*
+	Type definitions
+*/
+
+// Cache name length in a sample
+#define PROFILE_NAME_LEN 32
+
+// Hash table size (twice the sample limit keeps probes short)
+#define PROFILE_TABLE_SIZE (2*PROFILE_MAX_SAMPLES)
+
+// Live sampled allocation
+typedef struct profile_record
+{
+	void *obj;
+	size_t size;
+	char cache[PROFILE_NAME_LEN];
+	int depth;
+	void *stack[PROFILE_MAX_DEPTH];
+}profile_record_t;
+
+
+
+
+/*
+	Global variables
+*/
+
+// Sampled allocations, keyed by object address
+profile_record_t profile_table[PROFILE_TABLE_SIZE];
+
+// Number of live samples
+unsigned int profile_count;
+
+// Samples dropped because the table was full
+unsigned long profile_dropped;
+
+// Mean bytes between samples (0 - off)
+size_t profile_period;
+
+// Profiler mutex
+kmutex_t profile_mutex;
+char profile_mutex_ready;
+
+// Profiler mutex taken by profile_lock
+char profile_held;
+
+// Bytes left until this thread takes the next sample
+KMEM_THREAD_LOCAL long profile_countdown;
+
+// Per-thread random state
+KMEM_THREAD_LOCAL uint64_t profile_seed;
+
+
+
+
+/*
+	Hash table
+*/
+
+// Home slot of obj
+#define profile_home(obj) (unsigned int)((((uintptr_t)(obj) >> 4) * 0x9E3779B97F4A7C15ull >> 32) % PROFILE_TABLE_SIZE)
+
+// Finds the slot of obj (or the empty slot where it would go)
+unsigned int profile_find(void *obj)
+{
+	unsigned int i = profile_home(obj);
+
+	while (profile_table[i].obj != NULL && profile_table[i].obj != obj)
+		i = (i + 1) % PROFILE_TABLE_SIZE;
+
+	return i;
+}
+
+
+// Empties slot i, shifting later entries of the probe run back
+void profile_remove(unsigned int i)
+{
+	unsigned int j = i, home;
+
+	for (;;)
+	{
+		j = (j + 1) % PROFILE_TABLE_SIZE;
+
+		if (profile_table[j].obj == NULL)
+			break;
+
+		home = profile_home(profile_table[j].obj);
+
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		profile_table[i] = profile_table[j];
+		i = j;
+	}
+
+	profile_table[i].obj = NULL;
+	profile_count--;
+}
+
+
+
+
+/*
+	Sampling
+*/
+
+// Bytes until the next sample, uniform with mean profile_period
+long profile_next_interval(void)
+{
+	if (profile_period == 0)
+		return PROFILE_IDLE_INTERVAL;
+
+	if (profile_seed == 0)
+		profile_seed = (uint64_t)current_thread() | 1;
+
+	profile_seed ^= profile_seed << 13;
+	profile_seed ^= profile_seed >> 7;
+	profile_seed ^= profile_seed << 17;
+
+	return (long)(profile_seed % (2 * profile_period)) + 1;
+}
+
+
+// Record a stack trace for obj
+int profile_sample(const char *cache_name, void *obj, size_t size)
+{
+	profile_record_t *record;
+	void *stack[PROFILE_MAX_DEPTH + 2];
+	int depth, sampled = 0;
+
+	profile_countdown = profile_next_interval();
+
+	if (profile_period == 0)
+		return 0;
+
+	// Skip the profiler's own frames
+	depth = backtrace(stack, PROFILE_MAX_DEPTH + 2) - 2;
+	if (depth < 0)
+		depth = 0;
+
+	wait(&profile_mutex);
+
+	if (profile_count < PROFILE_MAX_SAMPLES)
+	{
+		record = &profile_table[profile_find(obj)];
+
+		if (record->obj == NULL)
+			profile_count++;
+
+		record->obj = obj;
+		record->size = size;
+		strncpy(record->cache, cache_name, PROFILE_NAME_LEN - 1);
+		record->cache[PROFILE_NAME_LEN - 1] = '\0';
+		record->depth = depth;
+		memcpy(record->stack, stack + 2, depth * sizeof(void*));
+
+		sampled = 1;
+	}
+	else
+	{
+		profile_dropped++;
+	}
+
+	signal(&profile_mutex);
+
+	return sampled;
+}
+
+
+// Forget obj if it was sampled
+int profile_free(void *obj)
+{
+	unsigned int i;
+	int found = 0;
+
+	wait(&profile_mutex);
+
+	i = profile_find(obj);
+
+	if (profile_table[i].obj != NULL)
+	{
+		profile_remove(i);
+		found = 1;
+	}
+
+	signal(&profile_mutex);
+
+	return found;
+}
+
+
+// Forget all samples in [start, end)
+void profile_free_range(void *start, void *end)
+{
+	unsigned int i;
+
+	wait(&profile_mutex);
+
+	for (i = 0; i < PROFILE_TABLE_SIZE; i++)
+	{
+		// Removal shifts a later entry into i, so look at i again
+		while (profile_table[i].obj != NULL && (char*)profile_table[i].obj >= (char*)start && (char*)profile_table[i].obj < (char*)end)
+			profile_remove(i);
+	}
+
+	signal(&profile_mutex);
+}
+
+
+// Hold the profiler lock across fork
+void profile_lock(void)
+{
+	// The profiler may start while the lock is held, so remember whether it was taken
+	profile_held = profile_mutex_ready;
+
+	if (profile_held)
+		wait(&profile_mutex);
+}
+
+
+// Release the profiler lock after fork
+void profile_unlock(void)
+{
+	if (profile_held)
+		signal(&profile_mutex);
+
+	profile_held = 0;
+}
+
+
+// Start sampling
+void kmem_profile_start(size_t sample_bytes)
+{
+	if (!profile_mutex_ready)
+	{
+		initMutex(&profile_mutex);
+		profile_mutex_ready = 1;
+	}
+
+	// The first backtrace loads the unwinder, which allocates, so it must not happen under a cache lock
+	if (sample_bytes)
+	{
+		void *stack[1];
+		(void)backtrace(stack, 1);
+	}
+
+	profile_period = sample_bytes;
+	profile_countdown = profile_next_interval();
+}
+
+
+
+
+/*
+	Output
+*/
+
+// Same stack and cache
+#define same_site(a, b) ((a)->depth == (b)->depth && strcmp((a)->cache, (b)->cache) == 0 && memcmp((a)->stack, (b)->stack, (a)->depth * sizeof(void*)) == 0)
+
+// Write live samples grouped by stack and cache
+int kmem_profile_dump(const char *path)
+{
+	static char done[PROFILE_TABLE_SIZE];
+	char buffer[BUFSIZ];
+	profile_record_t *record, *other;
+	size_t bytes, estimate, period;
+	unsigned int i, j, count;
+	FILE *file;
+
+	if (!profile_mutex_ready)
+		return -1;
+
+	file = fopen(path, "w");
+	if (file == NULL)
+		return -1;
+
+	// A stream allocates its buffer on first write, which must not happen under profile_mutex
+	setvbuf(file, buffer, _IOFBF, sizeof(buffer));
+
+	wait(&profile_mutex);
+
+	period = profile_period;
+	memset(done, 0, sizeof(done));
+
+	fprintf(file, "heap profile: %u live samples, %lu dropped, sampling every %zu bytes\n\n", profile_count, profile_dropped, period);
+
+	for (i = 0; i < PROFILE_TABLE_SIZE; i++)
+	{
+		record = &profile_table[i];
+
+		if (record->obj == NULL || done[i])
+			continue;
+
+		count = 0;
+		bytes = estimate = 0;
+
+		for (j = i; j < PROFILE_TABLE_SIZE; j++)
+		{
+			other = &profile_table[j];
+
+			if (other->obj == NULL || done[j] || !same_site(record, other))
+				continue;
+
+			done[j] = 1;
+			count++;
+			bytes += other->size;
+
+			// Each sample stands for about one period of allocated bytes
+			estimate += other->size > period ? other->size : period;
+		}
+
+		fprintf(file, "%zu bytes estimated (%u samples, %zu bytes sampled) in %s\n", estimate, count, bytes, record->cache);
+		fflush(file);
+		backtrace_symbols_fd(record->stack, record->depth, fileno(file));
+		fprintf(file, "\n");
+	}
+
+	signal(&profile_mutex);
+
+	fclose(file);
+
+	return 0;
+}
@@ -5,10 +5,27 @@
 #include "slab.h"
 #include "buddy.h"
 #include "mutex.h"
+#include "profile.h"
+#include "telemetry.h"
+#include "trace.h"
 #include <memory.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// POSIX threads, mmap and shared memory (refill worker, telemetry, heap files)
+#ifndef _WIN32
+#define KMEM_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 /*
@@ -20,7 +37,7 @@
 
 // Size-N buffer constants
 #define MIN_BUFF_ORDER 5
-#define MAX_BUFF_ORDER 17
+#define MAX_BUFF_ORDER KMALLOC_MAX_ORDER
 #define SIZE_N_COUNT (MAX_BUFF_ORDER - MIN_BUFF_ORDER + 1)
 
 // Minimum number of objects per slab
@@ -32,6 +49,29 @@
 // Call destructor when object is set free
 //#define FREE_DTOR
 
+// Keep full slabs on a list (debugging, statistics)
+//#define SLAB_FULL_LIST
+
+// Number of occupancy buckets for partial slabs (1 - a single partial list)
+#ifndef PARTIAL_BUCKETS
+#define PARTIAL_BUCKETS 4
+#endif
+
+// Caches of the same shape without constructors share slabs
+#define CACHE_MERGE
+
+// Sparse slabs collected per kmem_cache_defrag pass
+#define DEFRAG_BATCH 32
+
+// Aligned range of 2^NEAR_ORDER blocks searched around a hint by kmem_cache_alloc_near
+#define NEAR_ORDER 4
+
+// Do not print error messages (printing may call malloc when kmalloc replaces it)
+//#define KMEM_SILENT
+
+// Pack cache descriptors without cache line padding (smaller, but threads on neighbouring caches share lines)
+//#define KMEM_PACKED_CACHES
+
 
 
 
@@ -45,6 +85,26 @@ typedef unsigned int index_t;
 // Slab type type
 typedef enum slab_type {empty, partial, full} slab_type_t;
 
+// Slab lists: empty, full, then partial slabs by occupancy (fullest last)
+#define LIST_EMPTY 0
+#define LIST_FULL 1
+#define LIST_PARTIAL(bucket) (2 + (bucket))
+#define LIST_COUNT LIST_PARTIAL(PARTIAL_BUCKETS)
+
+// Slab types kept on cache lists
+#ifdef SLAB_FULL_LIST
+#define slab_listed(type) 1
+#else
+#define slab_listed(type) ((type) != full)
+#endif
+
+// Caches that may become aliases of a merged cache
+#ifdef CACHE_MERGE
+#define cache_mergeable(ctor, dtor) ((ctor) == NULL && (dtor) == NULL)
+#else
+#define cache_mergeable(ctor, dtor) 0
+#endif
+
 
 
 
@@ -53,9 +113,31 @@ typedef enum slab_type {empty, partial, full} slab_type_t;
 	Pointer manipulations
 */
 
+// Heap-relative reference (0 is NULL), the same in every mapping of the heap
+typedef uintptr_t kmem_ref_t;
+
+// Conversions between references and pointers
+#define ref_of(ptr) ((ptr) ? (kmem_ref_t)((char*)(ptr) - (char*)kmem_base) : (kmem_ref_t)0)
+#define ptr_of(type, ref) ((ref) ? (type)((char*)kmem_base + (ref)) : (type)NULL)
+
 // Pointer offset calculation
 #define ptr_offset(ptr,offset) (void*)((char*)ptr + offset)
 
+// Round size up to a multiple of align
+#define align_up(size, align) (((size) + (align) - 1) / (align) * (align))
+
+// Round pointer up to a multiple of align
+#define align_ptr(ptr, align) (void*)align_up((uintptr_t)(ptr), (uintptr_t)(align))
+
+// Objects (and the locks embedded in them) are at least word aligned
+#define OBJ_ALIGN sizeof(void*)
+
+// Alignment is a power of two
+#define is_power_of_two(value) ((value) != 0 && ((value) & ((value) - 1)) == 0)
+
+// Distance between slab colours (keeps aligned objects aligned)
+#define colour_step(align) ((align) > CACHE_L1_LINE_SIZE ? (align) : CACHE_L1_LINE_SIZE)
+
 
 
 /*
@@ -71,6 +153,7 @@ typedef unsigned char bitmap_entry_t;
 #define BITMAP_ENTRY_BITS 8
 #define bitmap_set_used(bitmap, index) bitmap[index/BITMAP_ENTRY_BITS] |= (1<<(index%BITMAP_ENTRY_BITS))
 #define bitmap_set_free(bitmap, index) bitmap[index/BITMAP_ENTRY_BITS] &= ~(1<<(index%BITMAP_ENTRY_BITS))
+#define bitmap_is_used(bitmap, index) ((bitmap[index/BITMAP_ENTRY_BITS] >> (index%BITMAP_ENTRY_BITS)) & 1)
 #define obj_per_entry (sizeof(bitmap_entry_t)*BITMAP_ENTRY_BITS)
 #define calc_bitmap_size(obj_count) ((obj_count / obj_per_entry + (obj_count%obj_per_entry!=0)) * sizeof(bitmap_entry_t))
 
@@ -92,7 +175,10 @@ typedef enum error_code {
 	err_cache_obj_alloc,
 	err_cache_obj_free,
 	err_buff_alloc,
-	err_buff_free
+	err_buff_free,
+	err_heap_file,
+	err_heap_busy,
+	err_telemetry
 } error_code_t;
 
 // Error messages
@@ -105,23 +191,32 @@ const char *error_text[] = {
 	"Object allocation failed!",
 	"Object dealloaction failed!",
 	"Buffer allocation failed!",
-	"Buffer dealloaction failed!"
+	"Buffer dealloaction failed!",
+	"Heap file mapping failed!",
+	"Heap file is in use by another process!",
+	"Telemetry segment mapping failed!"
 };
 
 // Print error message
 void print_error(error_code_t code)
 {
-	printf_s("Error: %s\n", error_text[code-1]);
+#ifndef KMEM_SILENT
+	printf("Error: %s\n", error_text[code-1]);
+#endif
 }
 
 // Validate expression
-#define val_exp(expression) if(!expression) assert(expression)
+#define val_exp(expression) if(!(expression)) assert(expression)
 
 // Check arguments for functions with pointer return value
-#define arg_check_null(arg_exp) if(!arg_exp) { print_error(err_arg); return 0; }
+#define arg_check_null(arg_exp) if(!(arg_exp)) { print_error(err_arg); return 0; }
 
 // Check function arguments for void functions
-#define arg_check(arg_exp) if(!arg_exp) { print_error(err_arg); return; }
+#define arg_check(arg_exp) if(!(arg_exp)) { print_error(err_arg); return; }
+
+// Objects freed by other threads can be queued without the cache lock
+// A queued object still looks live to its slab, so defragmentation of a movable cache would move the queue link
+#define remote_free_allowed(cache) ((cache)->ctor == NULL && (cache)->reloc == NULL && (cache)->object_size >= sizeof(void*))
 
 // Check function return value
 #define ret_check_null(ret,error_code, mutex) if(ret == NULL) { print_error(error_code); signal(mutex); return 0; }
@@ -136,57 +231,108 @@ void print_error(error_code_t code)
 // Slab structure
 typedef struct slab
 {
-	kmem_cache_t *cache;
+	kmem_ref_t cache;
 	slab_type_t type;
+	unsigned int list;
 
-	block_area_t my_hook;
 	index_t index;
 
 	unsigned int used_count;
 	unsigned int offset;
+	unsigned int sampled;
 
-	bitmap_entry_t *bitmap;
-
-	void *objects;
+	unsigned int objects;
+	unsigned int pristine;
 
-	struct slab *next;
+	kmem_ref_t next;
+	kmem_ref_t prev;
 
 }slab_t;
 
-
-// Cache structure
+// Start of the blocks holding a slab
+#define slab_area(slab) (void*)((char*)(slab) - (slab)->offset)
+
+// Slab fields kept as references or offsets
+#define slab_cache(slab) ptr_of(kmem_cache_t*, (slab)->cache)
+#define slab_next(slab) ptr_of(slab_t*, (slab)->next)
+#define slab_prev(slab) ptr_of(slab_t*, (slab)->prev)
+#define slab_bitmap(slab) ((bitmap_entry_t*)((slab) + 1))
+#define slab_objects(slab) ptr_offset(slab, (slab)->objects)
+
+
+// Field starts a new cache line (the structure is padded to whole lines)
+#if defined(KMEM_PACKED_CACHES)
+#define L1_ALIGNED
+#elif defined(_MSC_VER)
+#define L1_ALIGNED __declspec(align(CACHE_L1_LINE_SIZE))
+#else
+#define L1_ALIGNED __attribute__((aligned(CACHE_L1_LINE_SIZE)))
+#endif
+
+// Alignment of cache descriptors in kmem_cache
+#ifdef KMEM_PACKED_CACHES
+#define CACHE_DESC_ALIGN OBJ_ALIGN
+#else
+#define CACHE_DESC_ALIGN CACHE_L1_LINE_SIZE
+#endif
+
+// Cache structure, grouped so threads on different caches or paths do not share lines
 typedef struct kmem_cache_s
 {
-	char name[CACHE_NAME_LEN];
-
-	slab_t *heads[3];
-
+	// Read on every call, written only when the cache is set up
+	kmem_ref_t backing;
 	size_t object_size;
-	unsigned int bitmap_length;
-
-	unsigned int slab_order;
-	unsigned int slab_count[3];
-	
-	index_t next_offset;
-
 	unsigned int obj_per_slab;
-	unsigned int max_alignments;
+	unsigned int bitmap_length;
+	unsigned int low_watermark;
+	thread_id_t owner;
 
 	void(*ctor)(void *);
 	void(*dtor)(void *);
+	const kmem_reloc_ops_t *reloc;
 
+	// Lock and the state it guards
+	L1_ALIGNED kmutex_t mutex;
+
+	kmem_ref_t heads[LIST_COUNT];
+	unsigned int slab_count[3];
+	unsigned int free_objects;
+	unsigned long alloc_count;
+	unsigned long free_count;
+
+	index_t next_offset;
 	char extended;
-	
 	error_code_t error;
 
-	char mutex_space[MUTEX_SIZE];
-	mutex_t mutex;
+	kmem_waiter_t *wait_head;
+	kmem_waiter_t *wait_tail;
+
+	// Written by other threads without the lock
+	L1_ALIGNED kmem_ref_t remote_free;
+	unsigned int alias_used;
+
+	// Configuration and bookkeeping off the fast path
+	L1_ALIGNED char name[CACHE_NAME_LEN];
+
+	size_t align;
+	block_count_t slab_blocks;
+	unsigned int max_alignments;
+	unsigned int min_free;
+
+	char resumed;
 
-	struct kmem_cache_s *next;
+	unsigned int aliases;
+	kmem_ref_t next;
 
-	//mutex
 }kmem_cache_t;
 
+// Cache fields kept as references
+#define cache_head(cache, list) ptr_of(slab_t*, (cache)->heads[list])
+#define cache_next(cache) ptr_of(kmem_cache_t*, (cache)->next)
+
+// Cache holding the objects (an alias uses its merged cache)
+#define cache_store(cache) ((cache)->backing ? ptr_of(kmem_cache_t*, (cache)->backing) : (cache))
+
 
 // Small memory buffer
 typedef struct kmem_buff_s
@@ -200,11 +346,27 @@ typedef struct kmem_buff_s
 // Cache control structure
 typedef struct kmem_ctrl_s
 {
+	unsigned int magic;
+	unsigned int layout;
+
+	kmem_ref_t sem;
+	kmem_ref_t buddy_sem;
+	kmem_ref_t block_map;	// 0 - the map is mapped outside the heap
+
 	kmem_cache_t cache;
 	kmem_buff_t buffers[SIZE_N_COUNT];
 
 }kmem_ctrl_t;
 
+// Marks a heap that can be attached
+#define KMEM_MAGIC 0x6b6d656d
+
+
+
+
+// Cache belongs to the size-N buffers
+#define is_buffer_cache(cachep) ((kmem_buff_t*)(cachep) >= kmem_ctrl->buffers && (kmem_buff_t*)(cachep) < kmem_ctrl->buffers + SIZE_N_COUNT)
+
 
 
 
@@ -212,12 +374,33 @@ typedef struct kmem_ctrl_s
 	Global variables
 */
 
+// Heap start (base of all references)
+void *kmem_base;
+
 // Allocator control structure
 kmem_ctrl_t *kmem_ctrl;
 
-// Shared mutex
+// Cache list mutex
 mutex_t sem;
 
+// Owner slab of every buddy block
+kmem_ref_t *block_map;
+
+// Length of a block map mapped outside the heap (0 - the map is in the heap)
+size_t block_map_mapped;
+
+// Held by the refill worker for a pass over the cache list
+kmutex_t refill_mutex;
+
+// Allocation requests queued on all caches
+unsigned int kmem_waiting;
+
+// Large buffers with a live profiler sample
+unsigned int large_sampled;
+
+// Wake the refill worker
+void kmem_refill_kick(void);
+
 
 
 
@@ -230,31 +413,31 @@ mutex_t sem;
 mutex_t buddy_sem;
 
 
-// Allocate blocks
-block_area_t block_alloc(unsigned int order)
+// Allocate count blocks (*zero set if they are known to be zero)
+void *block_alloc(block_count_t count, char *zero)
 {
 	wait(buddy_sem);
 
-	block_area_t hook = buddy_alloc(order);
+	void *addr = buddy_alloc_blocks(count, zero);
 	
 	
-	if (hook.addr == NULL)
+	if (addr == NULL)
 	{
 		print_error(err_malloc);
 	}
 
 	signal(buddy_sem);
 
-	return hook;
+	return addr;
 }
 
 
-// Free blocks
-void mem_free(block_area_t area)
+// Free count blocks
+void mem_free(void *addr, block_count_t count)
 {
 	wait(buddy_sem);
 
-	if (buddy_free(&area) != 0)
+	if (buddy_free_blocks(addr, count) != 0)
 		print_error(err_free);
 
 	signal(buddy_sem);
@@ -268,10 +451,52 @@ void mem_free(block_area_t area)
 	Slab implementation
 */
 
-// Calculates slab order so minimum one object fits
-unsigned int calc_slab_order(size_t obj_size)
+// Calculates slab size in blocks so minimum one object fits
+block_count_t calc_slab_blocks(size_t obj_size, size_t align)
+{
+	size_t size = sizeof(slab_t) + obj_size*MIN_OBJ_CNT + OBJ_ALIGN + (align - OBJ_ALIGN);
+
+	return size_in_blocks(size);
+}
+
+
+// Records the owner slab of count blocks at addr
+void slab_map_set(void *addr, block_count_t count, kmem_ref_t slab)
+{
+	block_index_t index = buddy_index_of(addr);
+	block_count_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		__atomic_store_n(&block_map[index + i], slab, __ATOMIC_RELAXED);
+	}
+}
+
+
+// Map entry for the blocks of a large buffer starting at block index
+#define large_tag(index) ((kmem_ref_t)(((uintptr_t)(index) << 1) | 1))
+#define is_large_tag(entry) (((entry) & 1) != 0)
+#define large_index(entry) (block_index_t)((entry) >> 1)
+
+
+// Finds the block map entry for ptr (0 if ptr is outside the heap)
+kmem_ref_t slab_map_get(const void *ptr)
 {
-	return calc_block_order(sizeof(slab_t) + obj_size*MIN_OBJ_CNT + sizeof(bitmap_entry_t));
+	block_index_t index = buddy_index_of((void*)ptr);
+
+	if (index >= buddy_block_count())
+		return 0;
+
+	return __atomic_load_n(&block_map[index], __ATOMIC_RELAXED);
+}
+
+
+// Finds the slab holding ptr (NULL if ptr is not in a slab)
+slab_t *slab_find(const void *ptr)
+{
+	kmem_ref_t entry = slab_map_get(ptr);
+
+	return is_large_tag(entry) ? NULL : ptr_of(slab_t*, entry);
 }
 
 
@@ -280,44 +505,48 @@ slab_t *slab_alloc(kmem_cache_t *cache, index_t index)
 {
 	val_exp(cache != NULL);
 
-	block_area_t hook;
+	void *area;
 	slab_t *slab;
 	unsigned int offset;
 	void(*ctor)(void*) = cache->ctor;
 	int i;
+	char zero = 0;
 
-	hook = block_alloc(cache->slab_order);
+	area = block_alloc(cache->slab_blocks, &zero);
 
-	if (hook.addr == NULL)
+	if (area == NULL)
 		return NULL;
 
-	offset = (index % (cache->max_alignments)) * CACHE_L1_LINE_SIZE;
+	offset = (index % (cache->max_alignments)) * colour_step(cache->align);
 
-	slab = (slab_t*)ptr_offset(hook.addr, offset);
+	slab = (slab_t*)ptr_offset(area, offset);
 
-	slab->cache = cache;
-	slab->my_hook = hook;
-	slab->next = NULL;
+	slab->cache = ref_of(cache);
+	slab->next = slab->prev = 0;
 	slab->offset = offset;
 	slab->used_count = 0;
-	slab->bitmap = (bitmap_entry_t*)ptr_offset(slab,sizeof(slab_t));
-	slab->objects = ptr_offset(slab->bitmap, (cache->bitmap_length)*sizeof(bitmap_entry_t));
+	slab->sampled = 0;
+	slab->objects = (char*)align_ptr(ptr_offset(slab_bitmap(slab), (cache->bitmap_length)*sizeof(bitmap_entry_t)), cache->align) - (char*)slab;
 	slab->type = empty;
+	slab->list = LIST_EMPTY;
+
+	// Objects from this index on were never handed out and are still zero
+	slab->pristine = zero && ctor == NULL ? 0 : cache->obj_per_slab;
 
 	for (i = 0; i < cache->bitmap_length; i++)
 	{
-		slab->bitmap[i] = BITMAP_EMPTY;
+		slab_bitmap(slab)[i] = BITMAP_EMPTY;
 	}
 
-	
 	if (ctor)
 	{
 		for (i = 0; i < cache->obj_per_slab; i++)
 		{
-			ctor(ptr_offset(slab->objects, i*(cache->object_size)));
+			ctor(ptr_offset(slab_objects(slab), i*(cache->object_size)));
 		}
 	}
-	
+
+	kmem_trace(slab_alloc, cache->name, slab, cache->slab_blocks);
 
 	return slab;
 }
@@ -328,21 +557,30 @@ void slab_free(slab_t *slab, unsigned char call_dtor)
 {
 	val_exp(slab != NULL);
 
-	block_area_t hook = slab->my_hook;
-	kmem_cache_t *cache = slab->cache;
+	void *area = slab_area(slab);
+	kmem_cache_t *cache = slab_cache(slab);
 	void(*dtor)(void*) = cache->dtor;
 	int i;
 
+	kmem_trace(slab_free, cache->name, slab, slab->used_count);
+
 	if (dtor && call_dtor)
 	{
 		for (i = 0; i < cache->obj_per_slab; i++)
 		{
-			dtor(ptr_offset(slab->objects, i*cache->object_size));
+			dtor(ptr_offset(slab_objects(slab), i*cache->object_size));
 		}
 	}
 
 
-	mem_free(hook);
+	if (slab->sampled)
+		profile_free_range(area, ptr_offset(area, size_in_bytes(cache->slab_blocks)));
+
+	slab_map_set(area, cache->slab_blocks, 0);
+
+	cache->free_objects -= cache->obj_per_slab - slab->used_count;
+
+	mem_free(area, cache->slab_blocks);
 }
 
 // Puts the slab in the adequate list of owner cache
@@ -350,13 +588,22 @@ void slab_attach(slab_t *slab)
 {
 	val_exp(slab != NULL);
 
-	kmem_cache_t *cache = slab->cache;
+	kmem_cache_t *cache = slab_cache(slab);
 	slab_type_t type = slab->type;
-
-	slab->next = cache->heads[type];
-	cache->heads[type] = slab;
+	unsigned int list = slab->list;
 
 	cache->slab_count[type]++;
+
+	if (!slab_listed(type))
+		return;
+
+	slab->prev = 0;
+	slab->next = cache->heads[list];
+
+	if (slab->next)
+		slab_next(slab)->prev = ref_of(slab);
+
+	cache->heads[list] = ref_of(slab);
 }
 
 
@@ -365,58 +612,75 @@ int slab_detach(slab_t *slab)
 {
 	val_exp(slab != NULL);
 
-	kmem_cache_t *cache = slab->cache;
+	kmem_cache_t *cache = slab_cache(slab);
 	slab_type_t type = slab->type;
-	slab_t *cur, *prev;
 
-	prev = NULL;
-	cur = cache->heads[type];
+	cache->slab_count[type]--;
 
-	while (cur != slab)
-	{
-		prev = cur;
-		cur = cur->next;
-		if (cur == NULL)
-			return -1;
-	}
+	if (!slab_listed(type))
+		return 0;
 
-	if (prev)
+	if (slab->prev)
 	{
-		prev->next = cur->next;
+		slab_prev(slab)->next = slab->next;
 	}
 	else
 	{
-		cache->heads[type] = cur->next;
+		cache->heads[slab->list] = slab->next;
 	}
 
-	cache->slab_count[type]--;
+	if (slab->next)
+		slab_next(slab)->prev = slab->prev;
+
+	slab->next = slab->prev = 0;
 
 	return 0;
 }
 
 
-// Changes slab type and updates lists
-int slab_change_type(slab_t *slab, slab_type_t new_type)
+// Moves the slab to the list matching its occupancy
+int slab_update(slab_t *slab)
 {
 	val_exp(slab != NULL);
 
-	if (slab->type == new_type || slab_detach(slab) != 0)
+	kmem_cache_t *cache = slab_cache(slab);
+	slab_type_t new_type;
+	unsigned int new_list;
+
+	if (slab->used_count == 0)
+	{
+		new_type = empty;
+		new_list = LIST_EMPTY;
+	}
+	else if (slab->used_count == cache->obj_per_slab)
+	{
+		new_type = full;
+		new_list = LIST_FULL;
+	}
+	else
+	{
+		new_type = partial;
+		new_list = LIST_PARTIAL(slab->used_count * PARTIAL_BUCKETS / cache->obj_per_slab);
+	}
+
+	if (slab->list == new_list || slab_detach(slab) != 0)
 		return -1;
 
 	slab->type = new_type;
+	slab->list = new_list;
 	slab_attach(slab);
 
 	return 0;
 }
 
-// Allocate one object from slab (and change slab state)
-void *slab_alloc_object(slab_t *slab)
+// Allocate one object from slab (and change slab state), *zero set if it is known to be zero
+void *slab_alloc_object(slab_t *slab, char *zero)
 {
 	val_exp(slab != NULL);
 
 	index_t obj_index, i ,j;
-	bitmap_entry_t *bitmap = slab->bitmap; 
-	kmem_cache_t *cache = slab->cache;
+	bitmap_entry_t *bitmap = slab_bitmap(slab); 
+	kmem_cache_t *cache = slab_cache(slab);
 	void *obj;
 
 	for (i = 0; i < cache->bitmap_length; i++)
@@ -433,18 +697,19 @@ void *slab_alloc_object(slab_t *slab)
 
 	bitmap_set_used(bitmap, obj_index);
 
+	if (zero)
+		*zero = obj_index >= slab->pristine;
+
+	if (obj_index >= slab->pristine)
+		slab->pristine = obj_index + 1;
+
 	slab->used_count++;
+	cache->free_objects--;
+	cache->alloc_count++;
 
-	if (slab->used_count < cache->obj_per_slab && slab->type != partial)
-	{
-		slab_change_type(slab, partial);
-	}
-	else if(slab->used_count == cache->obj_per_slab)
-	{
-		slab_change_type(slab, full);
-	}
+	slab_update(slab);
 
-	obj = ptr_offset(slab->objects, obj_index*(slab->cache->object_size));
+	obj = ptr_offset(slab_objects(slab), obj_index*(cache->object_size));
 
 
 	return obj;
@@ -457,30 +722,30 @@ int slab_free_object(slab_t *slab, void *obj)
 	val_exp(slab != NULL && obj != NULL);
 
 	index_t obj_index;
-	void *start_addr = slab->objects;
-	void *end_addr = ptr_offset(start_addr, (slab->cache->obj_per_slab - 1)*(slab->cache->object_size));
+	kmem_cache_t *cache = slab_cache(slab);
+	void *start_addr = slab_objects(slab);
+	void *end_addr = ptr_offset(start_addr, (cache->obj_per_slab)*(cache->object_size));
 	void(*ctor)(void*), (*dtor)(void*);
 
-	if (!(start_addr <= obj && end_addr >= obj))
+	// Pointers inside an object (kmalloc_aligned) free the whole object
+	if (!(start_addr <= obj && end_addr > obj))
 		return -1;
 
-	ctor = slab->cache->ctor;
-	dtor = slab->cache->dtor;
+	ctor = cache->ctor;
+	dtor = cache->dtor;
 
-	obj_index = ((char*)obj - (char*)start_addr) / (slab->cache->object_size);
+	obj_index = ((char*)obj - (char*)start_addr) / (cache->object_size);
 
-	bitmap_set_free(slab->bitmap, obj_index);
+	bitmap_set_free(slab_bitmap(slab), obj_index);
+
+	if (slab->sampled && profile_free(ptr_offset(start_addr, obj_index*(cache->object_size))))
+		slab->sampled--;
 
 	slab->used_count--;
+	cache->free_objects++;
+	cache->free_count++;
 
-	if (slab->used_count == 0)
-	{
-		slab_change_type(slab, empty);
-	}
-	else if(slab->type != partial)
-	{
-		slab_change_type(slab, partial);
-	}
+	slab_update(slab);
 
 
 	#ifdef FREE_DTOR
@@ -506,27 +771,33 @@ int slab_free_object(slab_t *slab, void *obj)
 */
 
 // Initialize kmem_cache_t structure
-void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t obj_size, void(*ctor)(void *), void(*dtor)(void *))
+void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t obj_size, size_t align, void(*ctor)(void *), void(*dtor)(void *))
 {
 	val_exp(cache != NULL &&  obj_size > 0);
 	
 	size_t bitmap_size, free, slab_size, waste;
-	unsigned int obj_count, slab_order;
+	unsigned int obj_count, i;
+	block_count_t slab_blocks;
 
+	if (align < OBJ_ALIGN)
+		align = OBJ_ALIGN;
+
+	obj_size = align_up(obj_size, align);
 	obj_count = bitmap_size = 0;
-	slab_order = calc_slab_order(obj_size);
+	slab_blocks = calc_slab_blocks(obj_size, align);
 
-	slab_size = size_of_blocks(slab_order);
-	free = slab_size - sizeof(slab_t);
+	// Worst case padding between the bitmap and the first aligned object
+	slab_size = size_in_bytes(slab_blocks);
+	free = slab_size - sizeof(slab_t) - (align - OBJ_ALIGN);
 
 	while (bitmap_size + obj_count*obj_size <= free)
 	{
 		obj_count++;
-		bitmap_size = calc_bitmap_size(obj_count);
+		bitmap_size = align_up(calc_bitmap_size(obj_count), OBJ_ALIGN);
 	}
 
 	obj_count--;
-	bitmap_size = calc_bitmap_size(obj_count);
+	bitmap_size = align_up(calc_bitmap_size(obj_count), OBJ_ALIGN);
 	waste = free - (bitmap_size + obj_count*obj_size);
 
 
@@ -535,22 +806,50 @@ void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t obj_size, voi
 
 	cache->ctor = ctor;
 	cache->dtor = dtor;
+	cache->reloc = NULL;
 
 	cache->extended = -1;
 	cache->bitmap_length = bitmap_size / sizeof(bitmap_entry_t);
 	cache->obj_per_slab = obj_count;
 	cache->next_offset = 0;
-	cache->max_alignments = waste / CACHE_L1_LINE_SIZE + 1;
+	cache->max_alignments = waste / colour_step(align) + 1;
 	cache->object_size = obj_size;
-	cache->slab_order = slab_order;
-	cache->next = NULL;
-	cache->heads[empty] = cache->heads[partial] = cache->heads[full] = NULL;
+	cache->align = align;
+	cache->slab_blocks = slab_blocks;
+	cache->next = 0;
+	for (i = 0; i < LIST_COUNT; i++)
+	{
+		cache->heads[i] = 0;
+	}
 	cache->slab_count[empty] = cache->slab_count[partial] = cache->slab_count[full] = 0;
+	cache->free_objects = 0;
+	cache->alloc_count = cache->free_count = 0;
+	cache->min_free = 0;
+	cache->low_watermark = 0;
 	cache->error = (error_code_t)0;
 
-	cache->mutex = (mutex_t)cache->mutex_space;
-	initMutex(cache->mutex);
+	initMutex(&(cache->mutex));
+
+	cache->owner = current_thread();
+	cache->remote_free = 0;
+	cache->wait_head = cache->wait_tail = NULL;
+	cache->resumed = 0;
+
+	cache->backing = 0;
+	cache->aliases = 0;
+	cache->alias_used = 0;
+
+}
+
 
+// Put a newly built slab into the cache
+void kmem_cache_add_slab(kmem_cache_t *cache, slab_t *slab)
+{
+	// Published only now, so a slab still being built is never found in the map
+	slab_map_set(slab_area(slab), cache->slab_blocks, ref_of(slab));
+
+	slab_attach(slab);
+	cache->free_objects += cache->obj_per_slab;
 }
 
 
@@ -565,63 +864,120 @@ int kmem_cache_new_slab(kmem_cache_t *cache)
 
 	if (new_slab == NULL)
 	{
+		kmem_trace(cache_grow_fail, cache->name, cache->slab_blocks);
 		cache->error = err_cache_expand;
 		return -1;
 	}
 
-	slab_attach(new_slab);
+	kmem_cache_add_slab(cache, new_slab);
+	kmem_trace(cache_grow, cache->name, new_slab, cache->free_objects);
 	return 0;
 
 }
 
 
 // Add cache to global list
+// A link changes under sem and the mutex of the cache holding it, so the list can also be walked passing cache mutexes hand over hand
 void kmem_cache_list_add(kmem_cache_t *cache)
 {
+	wait(&(kmem_ctrl->cache.mutex));
+
 	cache->next = kmem_ctrl->cache.next;
-	kmem_ctrl->cache.next = cache;
+	kmem_ctrl->cache.next = ref_of(cache);
+
+	signal(&(kmem_ctrl->cache.mutex));
 }
 
 
 // Remove cache from global list
 int kmem_cache_list_remove(kmem_cache_t *cache)
 {
-	kmem_cache_t *cur = kmem_ctrl->cache.next, *prev = NULL;
+	kmem_cache_t *cur = cache_next(&(kmem_ctrl->cache)), *prev = &(kmem_ctrl->cache);
 
-	while (cur != cache)
+	while (cur && cur != cache)
 	{
 		prev = cur;
-		cur = cur->next;
+		cur = cache_next(cur);
 	}
 
 	if (cur == NULL)
 		return -1;
 
-	if (prev)
-	{
-		prev->next = cur->next;
-	}
-	else
+	// In list order, like a walk, which leaves cur only after it has locked the next cache
+	wait(&(prev->mutex));
+	wait(&(cur->mutex));
+
+	prev->next = cur->next;
+	cur->next = 0;
+
+	signal(&(cur->mutex));
+	signal(&(prev->mutex));
+
+	return 0;
+}
+
+
+// Give back a block map mapped outside the heap
+void block_map_release(void)
+{
+#ifdef KMEM_POSIX
+	if (block_map_mapped)
+		munmap(block_map, block_map_mapped);
+#endif
+
+	block_map_mapped = 0;
+}
+
+
+// Zero filled block map of map_size bytes for a new heap (zero - space is known to be zero filled)
+kmem_ref_t *block_map_create(size_t map_size, char zero)
+{
+	kmem_ref_t *map;
+
+	block_map_release();
+
+#ifdef KMEM_POSIX
+	// Clearing the map would fault in 8 bytes per block, a fresh mapping is zero filled and stays unbacked until written
+	if (!zero)
 	{
-		kmem_ctrl->cache.next = cur->next;
+		map = (kmem_ref_t*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		if (map == MAP_FAILED)
+			return NULL;
+
+		block_map_mapped = map_size;
+		return map;
 	}
+#endif
 
-	cur->next = NULL;
-	return 0;
+	map = (kmem_ref_t*)block_alloc(size_in_blocks(map_size), &zero);
+
+	if (map != NULL && !zero)
+		memset(map, 0, map_size);
+
+	return map;
 }
 
 
-// Initialize allocator
-void kmem_init(void *space, int block_num)
+// Initialize allocator (zero - space is known to be zero filled)
+void kmem_init_space(void *space, size_t block_num, char zero)
 {
 	val_exp(space != NULL && block_num > 0);
 
 	unsigned int order;
-	size_t size;
+	size_t size, map_size;
 	char name[CACHE_NAME_LEN];
+	kmem_ref_t *root;
+	int ret;
+
+	kmem_base = space;
 
-	buddy_init(space, block_num);
-	kmem_ctrl = (kmem_ctrl_t*)kernel_ctrl_alloc(sizeof(kmem_ctrl_t));
+	// Only the block heading each power of two is written, the rest of the space stays untouched
+	ret = zero ? buddy_init_zeroed(space, block_num) : buddy_init(space, block_num);
+	val_exp(ret == 0);
+	// The control structure outgrows the control block, its first slot keeps a reference to it
+	root = (kmem_ref_t*)kernel_ctrl_alloc(sizeof(kmem_ref_t));
+	*root = 0;
 
 	sem = (mutex_t)kernel_ctrl_alloc(MUTEX_SIZE);
 	val_exp(sem != NULL);
@@ -631,7 +987,22 @@ void kmem_init(void *space, int block_num)
 	val_exp(buddy_sem != NULL);
 	initMutex(buddy_sem);
 
-	kmem_cache_init(&(kmem_ctrl->cache), "kmem_cache", sizeof(kmem_cache_t), NULL, NULL);
+	kmem_ctrl = (kmem_ctrl_t*)block_alloc(size_in_blocks(sizeof(kmem_ctrl_t)), NULL);
+	val_exp(kmem_ctrl != NULL);
+	kmem_ctrl->magic = 0;
+	kmem_ctrl->layout = sizeof(kmem_ctrl_t);
+	kmem_ctrl->sem = ref_of(sem);
+	kmem_ctrl->buddy_sem = ref_of(buddy_sem);
+	*root = ref_of(kmem_ctrl);
+
+	initMutex(&refill_mutex);
+
+	map_size = buddy_block_count() * sizeof(kmem_ref_t);
+	block_map = block_map_create(map_size, zero);
+	val_exp(block_map != NULL);
+	kmem_ctrl->block_map = block_map_mapped ? 0 : ref_of(block_map);
+
+	kmem_cache_init(&(kmem_ctrl->cache), "kmem_cache", sizeof(kmem_cache_t), CACHE_DESC_ALIGN, NULL, NULL);
 
 	kmem_cache_new_slab(&(kmem_ctrl->cache));
 
@@ -639,329 +1010,2297 @@ void kmem_init(void *space, int block_num)
 	{
 		size = power_of_two(order);
 		sprintf(name, "Buffer_%d", order);
-		kmem_cache_init(&(kmem_ctrl->buffers[order - MIN_BUFF_ORDER].cache), name, size, NULL, NULL);
+		kmem_cache_init(&(kmem_ctrl->buffers[order - MIN_BUFF_ORDER].cache), name, size, size < CACHE_L1_LINE_SIZE ? size : CACHE_L1_LINE_SIZE, NULL, NULL);
 		kmem_ctrl->buffers[order - MIN_BUFF_ORDER].used = 0;
 	}
 
+	kmem_ctrl->magic = KMEM_MAGIC;
+
 }
 
 
-// Allocate one object from cache
-void *kmem_cache_alloc_obj(kmem_cache_t *cachep)
+// Initialize allocator
+void kmem_init(void *space, size_t block_num)
 {
-	void *obj = NULL;
+	kmem_init_space(space, block_num, 0);
+}
+
+
+// Initialize allocator in zero filled memory (fresh mappings)
+void kmem_init_zeroed(void *space, size_t block_num)
+{
+	kmem_init_space(space, block_num, 1);
+}
+
+
+// Set one object free from cache
+int kmem_cache_free_obj(kmem_cache_t *cachep, void *objp)
+{
+	slab_t *slab = slab_find(objp);
 
-	if (cachep->heads[partial])
+	if (slab == NULL || slab_cache(slab) != cachep || slab_free_object(slab, objp) != 0)
 	{
-		obj = slab_alloc_object(cachep->heads[partial]);
+		cachep->error = err_cache_obj_free;
+		return -1;
 	}
-	else
+
+	return 0;
+}
+
+
+// Destroy full slabs of a cache (found through the block map)
+void kmem_cache_free_full(kmem_cache_t *cachep)
+{
+	block_index_t index, count = buddy_block_count();
+	kmem_ref_t entry;
+	slab_t *slab;
+
+	for (index = 0; index < count && cachep->slab_count[full]; index++)
 	{
-		if (cachep->heads[empty] == NULL)
-		{
-			if (kmem_cache_new_slab(cachep) != 0)
-			{
-				cachep->error = err_cache_obj_alloc;
-				return NULL;
-			}
+		// Other caches set their entries at the same time
+		entry = __atomic_load_n(&block_map[index], __ATOMIC_RELAXED);
 
+		if (entry == 0 || is_large_tag(entry))
+			continue;
 
-			if (cachep->extended != -1)
-				cachep->extended = 1;
+		slab = ptr_of(slab_t*, entry);
+
+		if (slab_cache(slab) != cachep)
+			continue;
+
+		// The first block of one of its slabs, skip the rest of the slab
+		if (slab->type == full)
+		{
+			slab_detach(slab);
+			slab_free(slab, 1);
 		}
 
-		obj = slab_alloc_object(cachep->heads[empty]);
+		index += cachep->slab_blocks - 1;
 	}
-
-	return obj;
 }
 
 
-// Allocate one object from cache (thread-safe)
-void *kmem_cache_alloc(kmem_cache_t *cachep)
+// Start of the object of cachep holding objp (NULL if objp is not in one of its slabs), looked up without the lock
+void *kmem_cache_object_of(kmem_cache_t *cachep, const void *objp)
 {
-	void *obj = NULL;
+	slab_t *slab = slab_find(objp);
+	size_t offset;
 
-	arg_check_null(cachep != NULL);
+	if (slab == NULL || slab_cache(slab) != cachep || (char*)objp < (char*)slab_objects(slab))
+		return NULL;
 
-	wait(sem);
+	offset = (char*)objp - (char*)slab_objects(slab);
 
-	obj = kmem_cache_alloc_obj(cachep);
-	
-	signal(sem);
+	if (offset >= cachep->obj_per_slab * cachep->object_size)
+		return NULL;
 
-	return obj;
+	return ptr_offset(slab_objects(slab), offset / cachep->object_size * cachep->object_size);
 }
 
-// Find cache with a specific name
-kmem_cache_t *kmem_cache_find(char *name)
+
+// Queue an object freed by a non-owning thread (lock-free)
+void kmem_cache_remote_push(kmem_cache_t *cachep, void *objp)
 {
-	kmem_cache_t *cur = kmem_ctrl->cache.next;
+	kmem_ref_t head = __atomic_load_n(&(cachep->remote_free), __ATOMIC_RELAXED);
 
-	while (cur)
+	do
 	{
-		if (strcmp(name, cur->name) == 0)
-			return cur;
-		cur = cur->next;
-	}
-
-	return NULL;
+		*(kmem_ref_t*)objp = head;
+	} while (!__atomic_compare_exchange_n(&(cachep->remote_free), &head, ref_of(objp), 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 }
 
 
-// Create cache
-kmem_cache_t *kmem_cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *))
+// Return all queued remote frees to their slabs (cache must be locked)
+void kmem_cache_remote_drain(kmem_cache_t *cachep)
 {
-	kmem_cache_t *cache = NULL;
-	arg_check_null(name != NULL && size != 0);
+	kmem_ref_t head;
+	void *obj, *next;
 
-	wait(sem);
+	if (__atomic_load_n(&(cachep->remote_free), __ATOMIC_RELAXED) == 0)
+		return;
 
-	cache = kmem_cache_find(name);
+	// Ordered against kmem_waiting, so a pushing thread and a queuing one cannot both miss each other
+	head = __atomic_exchange_n(&(cachep->remote_free), 0, __ATOMIC_SEQ_CST);
+	obj = ptr_of(void*, head);
 
-	if (cache == NULL)
+	while (obj)
 	{
-		cache = (kmem_cache_t*)kmem_cache_alloc_obj(&(kmem_ctrl->cache));
-		ret_check_null(cache, err_cache_create, sem);
-
-		kmem_cache_init(cache, name, size, ctor, dtor);
-
-		kmem_cache_list_add(cache);
+		next = ptr_of(void*, *(kmem_ref_t*)obj);
+		kmem_cache_free_obj(cachep, obj);
+		obj = next;
 	}
-	
-	signal(sem);
-	
-	return cache;
 }
 
 
-// Shrink cache
-int kmem_cache_shrink(kmem_cache_t *cachep)
+// Fullest partial slab of a cache
+slab_t *kmem_cache_partial(kmem_cache_t *cachep)
 {
-	unsigned int free_slabs = 0;
-	slab_t *slab,*next;
-
-	arg_check_null(cachep != NULL);
+	int bucket;
 
-	wait(cachep->mutex);
-
-	if (!(cachep->extended) && cachep->heads[empty] || cachep->extended == -1)
+	for (bucket = PARTIAL_BUCKETS - 1; bucket >= 0; bucket--)
 	{
-		slab = cachep->heads[empty];
-		while (slab)
-		{
-			next = slab->next;
-			slab_detach(slab);
-			slab_free(slab,0);
-			slab = next;
-
-			free_slabs++;
-		}
+		if (cachep->heads[LIST_PARTIAL(bucket)])
+			return cache_head(cachep, LIST_PARTIAL(bucket));
 	}
 
-	cachep->extended = 0;
-
-	signal(cachep->mutex);
-
-	return (int)(free_slabs * power_of_two(cachep->slab_order));
+	return NULL;
 }
 
 
-// Set one object free from cache
-int kmem_cache_free_obj(kmem_cache_t *cachep, void *objp)
+// Allocate one object from cache (*zero set if it is known to be zero)
+void *kmem_cache_alloc_obj(kmem_cache_t *cachep, char *zero)
 {
+	void *obj = NULL;
+
 	slab_t *slab;
-	unsigned int i;
 
-	for (i = partial; i <= full; i++)
+	if (cachep->owner == current_thread() || !(cachep->slab_count[partial] || cachep->heads[LIST_EMPTY]))
+		kmem_cache_remote_drain(cachep);
+
+	slab = kmem_cache_partial(cachep);
+
+	if (slab)
 	{
-		slab = cachep->heads[i];
-		while (slab)
+		obj = slab_alloc_object(slab, zero);
+	}
+	else
+	{
+		if (cachep->heads[LIST_EMPTY] == 0)
 		{
-			if (slab_free_object(slab, objp) == 0)
+			if (kmem_cache_new_slab(cachep) != 0)
 			{
-				return 0;
+				kmem_trace(alloc_fail, cachep->name, cachep->object_size);
+				cachep->error = err_cache_obj_alloc;
+				return NULL;
 			}
-			slab = slab->next;
+
+
+			if (cachep->extended != -1)
+				cachep->extended = 1;
 		}
+
+		obj = slab_alloc_object(cache_head(cachep, LIST_EMPTY), zero);
 	}
 
-	cachep->error = err_cache_obj_free;
+	return obj;
+}
 
-	return -1;
+
+// Record an allocation from alias (backed by cachep) for the heap profiler, with no lock held since the stack walk may allocate
+void kmem_cache_sample(kmem_cache_t *cachep, kmem_cache_t *alias, void *obj)
+{
+	if (!profile_sample(alias->name, obj, cachep->object_size))
+		return;
+
+	// The slab stays while obj is live, its sample count is guarded by the cache lock
+	wait(&(cachep->mutex));
+
+	slab_find(obj)->sampled++;
+
+	signal(&(cachep->mutex));
 }
 
 
-// Set one object free from cache (thread-safe)
-void kmem_cache_free(kmem_cache_t *cachep, void *objp)
+// Slab of cache with a free object holding hint, or nearest to it in the aligned block range around it (cache must be locked)
+slab_t *kmem_cache_near_slab(kmem_cache_t *cachep, const void *hint)
 {
-	arg_check(cachep != NULL && objp != NULL);
+	block_index_t index = buddy_index_of((void*)hint), first, last, start, end, dist;
+	slab_t *slab = slab_find(hint);
+
+	if (index == 0 || index >= buddy_block_count())
+		return NULL;
 
-	wait(cachep->mutex);
+	if (slab && slab_cache(slab) == cachep && slab->used_count < cachep->obj_per_slab)
+		return slab;
 
-	kmem_cache_free_obj(cachep, objp);
+	// Blocks taken by the hint's own slab are skipped
+	first = last = index;
+	if (slab)
+	{
+		first = buddy_index_of(slab_area(slab));
+		last = first + slab_cache(slab)->slab_blocks - 1;
+	}
+
+	// Buddy blocks are numbered from 1
+	start = ((index - 1) & ~(power_of_two(NEAR_ORDER) - 1)) + 1;
+	end = start + power_of_two(NEAR_ORDER);
+	if (end > buddy_block_count())
+		end = buddy_block_count();
+
+	// Outward from the hint, one block on each side at a time
+	for (dist = 1; dist < power_of_two(NEAR_ORDER); dist++)
+	{
+		if (first >= start + dist && (slab = slab_find(buddy_block_addr(first - dist))) && slab_cache(slab) == cachep && slab->used_count < cachep->obj_per_slab)
+			return slab;
+
+		if (last + dist < end && (slab = slab_find(buddy_block_addr(last + dist))) && slab_cache(slab) == cachep && slab->used_count < cachep->obj_per_slab)
+			return slab;
+	}
 
-	signal(cachep->mutex);
+	return NULL;
 }
 
 
-// Destroy cache
-void kmem_cache_destroy(kmem_cache_t *cachep)
+// Allocate one object from cache (thread-safe), from a slab near hint if possible, *zero set if it is known to be zero
+void *kmem_cache_alloc_zero(kmem_cache_t *cachep, const void *hint, char *zero)
 {
-	unsigned int i;
-	slab_t *slab, *next;
+	kmem_cache_t *alias = cachep;
+	slab_t *slab = NULL;
+	void *obj = NULL;
 
-	arg_check(cachep != NULL);
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	if (hint)
+		slab = kmem_cache_near_slab(cachep, hint);
+
+	obj = slab ? slab_alloc_object(slab, zero) : kmem_cache_alloc_obj(cachep, zero);
+
+	if (cachep->free_objects < cachep->low_watermark)
+		kmem_refill_kick();
+	
+	signal(&(cachep->mutex));
+
+	if (obj && profile_tick(cachep->object_size))
+		kmem_cache_sample(cachep, alias, obj);
+
+	if (obj && alias != cachep)
+		__atomic_fetch_add(&(alias->alias_used), 1, __ATOMIC_RELAXED);
+
+	return obj;
+}
+
+
+// Allocate one object from cache (thread-safe)
+void *kmem_cache_alloc(kmem_cache_t *cachep)
+{
+	arg_check_null(cachep != NULL);
+
+	return kmem_cache_alloc_zero(cachep, NULL, NULL);
+}
+
+
+// Allocate one object from cache, preferably next to hint (thread-safe)
+void *kmem_cache_alloc_near(kmem_cache_t *cachep, const void *hint)
+{
+	arg_check_null(cachep != NULL);
+
+	return kmem_cache_alloc_zero(cachep, hint, NULL);
+}
 
-	wait(cachep->mutex);
 
-	for (i = empty; i <= full; i++)
+// Allocate one zero filled object from cache (thread-safe)
+void *kmem_cache_zalloc(kmem_cache_t *cachep)
+{
+	void *obj;
+	char zero = 0;
+
+	arg_check_null(cachep != NULL);
+
+	obj = kmem_cache_alloc_zero(cachep, NULL, &zero);
+
+	// Only objects that may have been used before are cleared
+	if (obj && !zero)
+		memset(obj, 0, cachep->object_size);
+
+	return obj;
+}
+
+// Hand free objects to the queued requests of a cache in FIFO order (cache must be locked)
+// Served requests are appended at tail, grow allows new slabs for them, returns the new tail
+kmem_waiter_t **kmem_cache_serve(kmem_cache_t *cachep, kmem_waiter_t **tail, char grow)
+{
+	kmem_waiter_t *waiter;
+	void *obj;
+
+	kmem_cache_remote_drain(cachep);
+
+	while (cachep->wait_head && (cachep->free_objects || grow))
 	{
-		slab = cachep->heads[i];
-		while (slab)
-		{
-			next = slab->next;
-			slab_detach(slab);
-			slab_free(slab, 1);
-			slab = next;
-		}
+		obj = kmem_cache_alloc_obj(cachep, NULL);
+
+		// Later requests stay behind the first one
+		if (obj == NULL)
+			break;
+
+		waiter = cachep->wait_head;
+		cachep->wait_head = waiter->next;
+
+		if (waiter->cache != cachep)
+			__atomic_fetch_add(&(waiter->cache->alias_used), 1, __ATOMIC_RELAXED);
+
+		waiter->obj = obj;
+		waiter->next = NULL;
+		*tail = waiter;
+		tail = &(waiter->next);
+
+		__atomic_fetch_sub(&kmem_waiting, 1, __ATOMIC_SEQ_CST);
 	}
 
-	val_exp(kmem_cache_list_remove(cachep)==0);
+	if (cachep->wait_head == NULL)
+		cachep->wait_tail = NULL;
 
-	kmem_cache_free_obj(&(kmem_ctrl->cache), cachep);
+	return tail;
+}
+
+
+// Run the callbacks of served requests (no locks may be held)
+void kmem_waiters_complete(kmem_waiter_t *served)
+{
+	kmem_waiter_t *next;
 
-	signal(cachep->mutex);
+	while (served)
+	{
+		// The callback may reuse the request
+		next = served->next;
+		served->callback(served->obj, served->arg);
+		served = next;
+	}
+}
+
+
+// Serve the queued requests of one cache
+void kmem_cache_wake(kmem_cache_t *cachep)
+{
+	kmem_waiter_t *served = NULL;
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_serve(cachep, &served, 0);
 
+	signal(&(cachep->mutex));
+
+	kmem_waiters_complete(served);
 }
 
 
-// Allocate one small memmory buffer
-void *kmalloc(size_t size)
+// Serve the queued requests of every cache after blocks went back to the buddy allocator
+void kmem_wake_all(void)
 {
-	unsigned int order = 0;
-	void *buff = NULL;
+	kmem_waiter_t *served = NULL, **tail = &served;
+	kmem_cache_t *cache;
 
-	arg_check_null(size != 0);
+	if (__atomic_load_n(&kmem_waiting, __ATOMIC_SEQ_CST) == 0)
+		return;
 
 	wait(sem);
 
-	while (power_of_two(order) < size) order++;
-	
-	kmem_ctrl->buffers[order - MIN_BUFF_ORDER].used = 1;
+	for (cache = cache_next(&(kmem_ctrl->cache)); cache; cache = cache_next(cache))
+	{
+		// A request may be queued right now, so every cache is looked at under its lock
+		wait(&(cache->mutex));
+
+		tail = kmem_cache_serve(cache, tail, 1);
+
+		signal(&(cache->mutex));
+	}
 
-	
-	buff = kmem_cache_alloc_obj(&(kmem_ctrl->buffers[order - MIN_BUFF_ORDER].cache));
-	ret_check_null(buff, err_buff_alloc,sem);
-	
 	signal(sem);
 
-	return buff;
+	kmem_waiters_complete(served);
+}
+
+
+// Allocate one object from cache into *objp or queue the request until one is freed (thread-safe)
+int kmem_cache_alloc_async(kmem_cache_t *cachep, kmem_waiter_t *waiter, kmem_alloc_cb_t callback, void *arg, void **objp)
+{
+	kmem_cache_t *alias = cachep;
+	void *obj = NULL;
+
+	if (cachep == NULL || waiter == NULL || callback == NULL || objp == NULL)
+	{
+		print_error(err_arg);
+		return -1;
+	}
 
+	*objp = NULL;
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	// Counted before the attempt, so a free that races with it finds the request
+	__atomic_fetch_add(&kmem_waiting, 1, __ATOMIC_SEQ_CST);
+
+	// Requests already queued are served first
+	if (cachep->wait_head == NULL)
+		obj = kmem_cache_alloc_obj(cachep, NULL);
+
+	if (obj)
+	{
+		__atomic_fetch_sub(&kmem_waiting, 1, __ATOMIC_SEQ_CST);
+	}
+	else
+	{
+		waiter->callback = callback;
+		waiter->arg = arg;
+		waiter->obj = NULL;
+		waiter->cache = alias;
+		waiter->next = NULL;
+
+		if (cachep->wait_tail)
+			cachep->wait_tail->next = waiter;
+		else
+			cachep->wait_head = waiter;
+
+		cachep->wait_tail = waiter;
+	}
+
+	if (cachep->free_objects < cachep->low_watermark)
+		kmem_refill_kick();
+
+	signal(&(cachep->mutex));
+
+	// Once queued the waiter belongs to the freeing thread
+	if (obj == NULL)
+		return 1;
+
+	if (profile_tick(cachep->object_size))
+		kmem_cache_sample(cachep, alias, obj);
+
+	if (alias != cachep)
+		__atomic_fetch_add(&(alias->alias_used), 1, __ATOMIC_RELAXED);
+
+	*objp = obj;
+
+	return 0;
 }
 
 
-// Set one small memmory buffer free
-void kfree(const void *objp)
+// Remove a queued request (returns 1 if it was still queued)
+int kmem_cache_alloc_cancel(kmem_cache_t *cachep, kmem_waiter_t *waiter)
 {
-	index_t index;
-	slab_t *slab;
-	unsigned int i;
-	kmem_cache_t *cachep;
+	kmem_waiter_t *cur, *prev = NULL;
 
-	arg_check(objp != NULL);
+	arg_check_null(cachep != NULL && waiter != NULL);
 
-	wait(sem);
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	for (cur = cachep->wait_head; cur && cur != waiter; cur = cur->next)
+		prev = cur;
 
-	for (index = 0; index < SIZE_N_COUNT; index++)
+	if (cur)
 	{
-		if (kmem_ctrl->buffers[index].used)
-		{
-			cachep = &(kmem_ctrl->buffers[index].cache);
+		if (prev)
+			prev->next = cur->next;
+		else
+			cachep->wait_head = cur->next;
 
-			for (i = partial; i <= full; i++)
-			{
-				slab = cachep->heads[i];
-				while (slab)
-				{
-					if (slab_free_object(slab, (void*)objp) == 0)
-					{
-						signal(sem);
-						return;
-					}
-					slab = slab->next;
-				}
-			}
+		if (cachep->wait_tail == cur)
+			cachep->wait_tail = prev;
+
+		__atomic_fetch_sub(&kmem_waiting, 1, __ATOMIC_SEQ_CST);
+	}
+
+	signal(&(cachep->mutex));
+
+	return cur != NULL;
+}
+
+
+// Unlink the queued requests made through alias, they complete without an object (cache must be locked)
+kmem_waiter_t *kmem_cache_unqueue_alias(kmem_cache_t *cachep, kmem_cache_t *alias)
+{
+	kmem_waiter_t *failed = NULL, **tail = &failed, **link = &(cachep->wait_head), *cur;
+
+	cachep->wait_tail = NULL;
+
+	while ((cur = *link) != NULL)
+	{
+		if (cur->cache != alias)
+		{
+			cachep->wait_tail = cur;
+			link = &(cur->next);
+			continue;
 		}
 
+		*link = cur->next;
+
+		cur->obj = NULL;
+		cur->next = NULL;
+		*tail = cur;
+		tail = &(cur->next);
+
+		__atomic_fetch_sub(&kmem_waiting, 1, __ATOMIC_SEQ_CST);
 	}
 
-	print_error(err_buff_free);
+	return failed;
+}
+
 
-	signal(sem);
+// Find cache with a specific name
+kmem_cache_t *kmem_cache_find(const char *name)
+{
+	kmem_cache_t *cur = cache_next(&(kmem_ctrl->cache));
+
+	while (cur)
+	{
+		if (strcmp(name, cur->name) == 0)
+			return cur;
+		cur = cache_next(cur);
+	}
 
+	return NULL;
 }
 
 
-// Print cache info
-void kmem_cache_info(kmem_cache_t *cachep)
+// Find the merged cache for objects of a given shape
+kmem_cache_t *kmem_cache_find_store(size_t size, size_t align)
 {
-	unsigned int total_obj, used_obj, total_slabs;
-	double usage = 0;
-	slab_t *slab;
+	kmem_cache_t *cur = cache_next(&(kmem_ctrl->cache));
 
-	arg_check(cachep != NULL);
+	while (cur)
+	{
+		if (cur->aliases && cur->object_size == size && cur->align == align)
+			return cur;
+		cur = cache_next(cur);
+	}
 
-	wait(sem);
+	return NULL;
+}
 
-	total_slabs = cachep->slab_count[empty] + cachep->slab_count[partial] + cachep->slab_count[full];
 
-	total_obj = total_slabs * cachep->obj_per_slab;
+// Create an alias cache sharing slabs with every cache of the same shape (sem must be held)
+kmem_cache_t *kmem_cache_alias(const char *name, size_t size, size_t align)
+{
+	kmem_cache_t *alias, *store;
+	char store_name[CACHE_NAME_LEN];
 
-	used_obj = 0;
+	if (align < OBJ_ALIGN)
+		align = OBJ_ALIGN;
+
+	size = align_up(size, align);
+
+	alias = (kmem_cache_t*)kmem_cache_alloc_obj(&(kmem_ctrl->cache), NULL);
+
+	if (alias == NULL)
+		return NULL;
+
+	store = kmem_cache_find_store(size, align);
 
-	slab = cachep->heads[partial];
-	while (slab)
+	if (store == NULL)
 	{
-		used_obj += slab->used_count;
-		slab = slab->next;
+		store = (kmem_cache_t*)kmem_cache_alloc_obj(&(kmem_ctrl->cache), NULL);
+
+		if (store == NULL)
+		{
+			kmem_cache_free_obj(&(kmem_ctrl->cache), alias);
+			return NULL;
+		}
+
+		// Not a valid user cache name, so kmem_cache_find never returns it
+		sprintf(store_name, ":merged-%u-%u", (unsigned int)size, (unsigned int)align);
+		kmem_cache_init(store, store_name, size, align, NULL, NULL);
+		kmem_cache_list_add(store);
 	}
 
-	used_obj += cachep->slab_count[full] * cachep->obj_per_slab;
+	kmem_cache_init(alias, name, size, align, NULL, NULL);
+	alias->backing = ref_of(store);
+	store->aliases++;
 
-	if(total_obj)
-		usage = 100 * ((double)used_obj / total_obj);
+	kmem_cache_list_add(alias);
+
+	return alias;
+}
 
-	printf_s("\nCache info\n");
-	printf_s("Name: %s\n",cachep->name);
-	printf_s("Object size: %d\n",cachep->object_size);
-	printf_s("Cache size in blocks: %d\n", size_in_blocks(sizeof(kmem_cache_t)) + total_slabs*(power_of_two(cachep->slab_order)));
-	printf_s("Number of slabs: %d\n", total_slabs);
-	printf_s("Objects per slab: %d\n", cachep->obj_per_slab);
-	printf_s("Used space: %.1f%%\n\n", usage);
 
-	signal(sem);
+// Cache holds objects of size bytes aligned to align, as kmem_cache_init would lay them out
+int cache_same_shape(kmem_cache_t *cache, size_t size, size_t align)
+{
+	if (align < OBJ_ALIGN)
+		align = OBJ_ALIGN;
 
+	return cache->object_size == align_up(size, align) && cache->align == align;
 }
 
 
-// Print cache error
-int kmem_cache_error(kmem_cache_t *cachep)
+// Create cache with aligned objects that defragmentation may move (reloc NULL for a fixed cache)
+kmem_cache_t *kmem_cache_create_movable(const char *name, size_t size, size_t align, void(*ctor)(void *), void(*dtor)(void *), const kmem_reloc_ops_t *reloc)
 {
-	arg_check_null(cachep != NULL);
+	kmem_cache_t *cache = NULL;
+	arg_check_null(name != NULL && size != 0 && (align == 0 || is_power_of_two(align)));
+	arg_check_null(reloc == NULL || (reloc->isolate != NULL && reloc->update != NULL));
 
 	wait(sem);
 
-	error_code_t error = cachep->error;
+	cache = kmem_cache_find(name);
 
-	if (error)
+	// A name already taken by objects of another shape is an error, handing that cache out would overrun its objects
+	if (cache && !cache_same_shape(cache, size, align))
 	{
-		print_error(error);
+		print_error(err_cache_create);
+		signal(sem);
+		return NULL;
+	}
+
+	// Objects of a merged cache belong to different users, so only their own cache can move them
+	if (cache == NULL && cache_mergeable(ctor, dtor) && reloc == NULL)
+	{
+		cache = kmem_cache_alias(name, size, align);
+		ret_check_null(cache, err_cache_create, sem);
+	}
+	else if (cache == NULL)
+	{
+		cache = (kmem_cache_t*)kmem_cache_alloc_obj(&(kmem_ctrl->cache), NULL);
+		ret_check_null(cache, err_cache_create, sem);
+
+		kmem_cache_init(cache, name, size, align, ctor, dtor);
+		cache->reloc = reloc;
+
+		kmem_cache_list_add(cache);
 	}
+	else if (cache->resumed)
+	{
+		wait(&(cache->mutex));
+
+		cache->ctor = ctor;
+		cache->dtor = dtor;
+		cache->reloc = reloc;
+		cache->resumed = 0;
 
+		signal(&(cache->mutex));
+	}
+	
 	signal(sem);
+	
+	return cache;
+}
 
-	return error;
+
+// Create cache with aligned objects
+kmem_cache_t *kmem_cache_create_aligned(const char *name, size_t size, size_t align, void(*ctor)(void *), void(*dtor)(void *))
+{
+	return kmem_cache_create_movable(name, size, align, ctor, dtor, NULL);
+}
+
+
+// Create cache
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, void(*ctor)(void *), void(*dtor)(void *))
+{
+	return kmem_cache_create_aligned(name, size, 0, ctor, dtor);
 }
 
 
+// Shrink cache
+int kmem_cache_shrink(kmem_cache_t *cachep)
+{
+	unsigned int free_slabs = 0;
+	slab_t *slab,*next;
+
+	arg_check_null(cachep != NULL);
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_remote_drain(cachep);
+
+	if ((!(cachep->extended) && cachep->heads[LIST_EMPTY]) || cachep->extended == -1)
+	{
+		slab = cache_head(cachep, LIST_EMPTY);
+
+		// Keep enough empty slabs for the minimum number of free objects
+		while (slab && cachep->free_objects >= cachep->min_free + cachep->obj_per_slab)
+		{
+			next = slab_next(slab);
+			slab_detach(slab);
+			slab_free(slab,0);
+			slab = next;
+
+			free_slabs++;
+		}
+	}
+
+	cachep->extended = 0;
+
+	kmem_trace(cache_shrink, cachep->name, free_slabs);
+
+	signal(&(cachep->mutex));
+
+	if (free_slabs)
+		kmem_wake_all();
+
+	return (int)(free_slabs * cachep->slab_blocks);
+}
+
+
+// Fullest partial slab of a cache other than skip
+slab_t *kmem_cache_partial_except(kmem_cache_t *cachep, slab_t *skip)
+{
+	slab_t *slab;
+	int bucket;
+
+	for (bucket = PARTIAL_BUCKETS - 1; bucket >= 0; bucket--)
+	{
+		for (slab = cache_head(cachep, LIST_PARTIAL(bucket)); slab; slab = slab_next(slab))
+		{
+			if (slab != skip)
+				return slab;
+		}
+	}
+
+	return NULL;
+}
+
+
+// Move the objects of slab into fuller slabs (cache must be locked), returns the number moved
+unsigned int kmem_cache_evacuate(kmem_cache_t *cachep, slab_t *slab)
+{
+	const kmem_reloc_ops_t *reloc = cachep->reloc;
+	bitmap_entry_t *bitmap = slab_bitmap(slab);
+	unsigned int moved = 0;
+	slab_t *dest;
+	void *obj, *new_obj;
+	index_t i;
+
+	for (i = 0; i < cachep->obj_per_slab && slab->used_count; i++)
+	{
+		if (!bitmap_is_used(bitmap, i))
+			continue;
+
+		// Only moves into a slab at least as full consolidate
+		dest = kmem_cache_partial_except(cachep, slab);
+
+		if (dest == NULL || dest->used_count < slab->used_count)
+			break;
+
+		obj = ptr_offset(slab_objects(slab), i*(cachep->object_size));
+
+		// A pinned object keeps the slab alive, so the rest may stay too
+		if (reloc->isolate(obj) != 0)
+			break;
+
+		new_obj = slab_alloc_object(dest, NULL);
+
+		if (reloc->move)
+			reloc->move(obj, new_obj);
+		else
+			memcpy(new_obj, obj, cachep->object_size);
+
+		reloc->update(obj, new_obj);
+
+		slab_free_object(slab, obj);
+		moved++;
+	}
+
+	return moved;
+}
+
+
+// Compact a movable cache and free the emptied slabs
+int kmem_cache_defrag(kmem_cache_t *cachep, unsigned int target_occupancy)
+{
+	slab_t *batch[DEFRAG_BATCH];
+	unsigned int count, moved, free_slabs = 0, i;
+	slab_t *slab, *next;
+	int bucket;
+
+	arg_check_null(cachep != NULL && target_occupancy <= 100);
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_remote_drain(cachep);
+
+	do
+	{
+		count = moved = 0;
+
+		// Sparsest slabs first
+		for (bucket = 0; bucket < PARTIAL_BUCKETS && count < DEFRAG_BATCH && cachep->reloc; bucket++)
+		{
+			for (slab = cache_head(cachep, LIST_PARTIAL(bucket)); slab && count < DEFRAG_BATCH; slab = slab_next(slab))
+			{
+				if (slab->used_count * 100 < target_occupancy * cachep->obj_per_slab)
+					batch[count++] = slab;
+			}
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			// Earlier moves may have filled it
+			if (batch[i]->used_count && batch[i]->used_count * 100 < target_occupancy * cachep->obj_per_slab)
+				moved += kmem_cache_evacuate(cachep, batch[i]);
+		}
+
+	} while (moved && count == DEFRAG_BATCH);
+
+	// Emptied slabs go back, leaving min_free objects
+	slab = cache_head(cachep, LIST_EMPTY);
+
+	while (slab && cachep->free_objects >= cachep->min_free + cachep->obj_per_slab)
+	{
+		next = slab_next(slab);
+		slab_detach(slab);
+		slab_free(slab, 0);
+		slab = next;
+
+		free_slabs++;
+	}
+
+	kmem_trace(cache_defrag, cachep->name, free_slabs);
+
+	signal(&(cachep->mutex));
+
+	if (free_slabs)
+		kmem_wake_all();
+
+	return (int)(free_slabs * cachep->slab_blocks);
+}
+
+
+// Grow cache until min_objects objects are free (returns 0 on success)
+int kmem_cache_reserve(kmem_cache_t *cachep, unsigned int min_objects)
+{
+	int ret = 0;
+
+	if (cachep == NULL)
+	{
+		print_error(err_arg);
+		return -1;
+	}
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_remote_drain(cachep);
+
+	while (cachep->free_objects < min_objects)
+	{
+		if (kmem_cache_new_slab(cachep) != 0)
+		{
+			ret = -1;
+			break;
+		}
+	}
+
+	signal(&(cachep->mutex));
+
+	return ret;
+}
+
+
+// Set the number of free objects kmem_cache_shrink leaves in the cache
+void kmem_cache_set_min_free(kmem_cache_t *cachep, unsigned int min_free)
+{
+	arg_check(cachep != NULL);
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	cachep->min_free = min_free;
+
+	signal(&(cachep->mutex));
+}
+
+
+// Set one object free from cache (thread-safe)
+void kmem_cache_free(kmem_cache_t *cachep, void *objp)
+{
+	kmem_waiter_t *served = NULL;
+	void *obj;
+
+	arg_check(cachep != NULL && objp != NULL);
+
+	if (cachep->backing)
+	{
+		__atomic_fetch_sub(&(cachep->alias_used), 1, __ATOMIC_RELAXED);
+		cachep = cache_store(cachep);
+	}
+
+	// The link is written into the object, so a pointer that is not one of ours takes the locked path and is reported there
+	if (remote_free_allowed(cachep) && cachep->owner != current_thread() && (obj = kmem_cache_object_of(cachep, objp)) != NULL)
+	{
+		kmem_cache_remote_push(cachep, obj);
+
+		// A request queued while the object was pushed is served here
+		if (__atomic_load_n(&kmem_waiting, __ATOMIC_SEQ_CST))
+			kmem_cache_wake(cachep);
+
+		return;
+	}
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_free_obj(cachep, objp);
+
+	if (cachep->wait_head)
+		kmem_cache_serve(cachep, &served, 0);
+
+	signal(&(cachep->mutex));
+
+	kmem_waiters_complete(served);
+}
+
+
+// Free all slabs and the descriptor of an unlinked cache
+void kmem_cache_teardown(kmem_cache_t *cachep)
+{
+	unsigned int i;
+	slab_t *slab, *next;
+	kmem_waiter_t *failed, *waiter;
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_remote_drain(cachep);
+
+	// Requests still queued complete without an object
+	failed = cachep->wait_head;
+	cachep->wait_head = cachep->wait_tail = NULL;
+
+	for (waiter = failed; waiter; waiter = waiter->next)
+		__atomic_fetch_sub(&kmem_waiting, 1, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < LIST_COUNT; i++)
+	{
+		slab = cache_head(cachep, i);
+		while (slab)
+		{
+			next = slab_next(slab);
+			slab_detach(slab);
+			slab_free(slab, 1);
+			slab = next;
+		}
+	}
+
+	kmem_cache_free_full(cachep);
+
+	signal(&(cachep->mutex));
+	destroyMutex(&(cachep->mutex));
+
+	wait(sem);
+
+	kmem_cache_free_obj(&(kmem_ctrl->cache), cachep);
+
+	signal(sem);
+
+	kmem_waiters_complete(failed);
+
+}
+
+
+// Destroy cache
+void kmem_cache_destroy(kmem_cache_t *cachep)
+{
+	kmem_cache_t *store;
+	kmem_waiter_t *failed = NULL;
+
+	arg_check(cachep != NULL);
+
+	// Unlinked first, so the refill worker cannot be building slabs for it
+	wait(&refill_mutex);
+	wait(sem);
+
+	val_exp(kmem_cache_list_remove(cachep)==0);
+
+	store = cachep;
+
+	// An alias only drops its reference, the last one takes the merged cache along
+	if (cachep->backing)
+	{
+		store = cache_store(cachep);
+
+		// Requests of this alias point at its descriptor, which is about to go
+		wait(&(store->mutex));
+		failed = kmem_cache_unqueue_alias(store, cachep);
+		signal(&(store->mutex));
+
+		if (--(store->aliases) == 0)
+		{
+			val_exp(kmem_cache_list_remove(store)==0);
+		}
+		else
+		{
+			store = NULL;
+		}
+
+		destroyMutex(&(cachep->mutex));
+		kmem_cache_free_obj(&(kmem_ctrl->cache), cachep);
+	}
+
+	signal(sem);
+	signal(&refill_mutex);
+
+	kmem_waiters_complete(failed);
+
+	if (store)
+	{
+		kmem_cache_teardown(store);
+		kmem_wake_all();
+	}
+
+}
+
+
+// Calculates size-N buffer order for size
+unsigned int calc_buff_order(size_t size)
+{
+	unsigned int order = MIN_BUFF_ORDER;
+
+	while (power_of_two(order) < size) order++;
+
+	return order;
+}
+
+
+// Allocate exactly as many blocks as size needs (*zero set if they are known to be zero)
+void *kmalloc_large(size_t size, char *zero)
+{
+	block_count_t count = size_in_blocks(size);
+	void *buff;
+
+	// Only buddy_sem is taken, the map entries of the new blocks belong to the caller
+	buff = block_alloc(count, zero);
+
+	if (buff == NULL)
+	{
+		kmem_trace(alloc_fail, "kmalloc_large", size);
+		return NULL;
+	}
+
+	slab_map_set(buff, count, large_tag(buddy_index_of(buff)));
+
+	// No lock is held here, so the profiler may walk the stack
+	if (profile_tick(size) && profile_sample("kmalloc_large", buff, size))
+		__atomic_fetch_add(&large_sampled, 1, __ATOMIC_RELAXED);
+
+	return buff;
+}
+
+
+// Number of blocks in the large buffer with map entry tag
+block_count_t large_block_count(kmem_ref_t tag)
+{
+	block_count_t count, total = buddy_block_count();
+	block_index_t index = large_index(tag);
+
+	// The entry past the run may be set by another thread at the same time
+	for (count = 0; index + count < total && __atomic_load_n(&block_map[index + count], __ATOMIC_RELAXED) == tag; count++);
+
+	return count;
+}
+
+
+// Free the large buffer holding objp (returns 0 on success)
+int kfree_large(const void *objp)
+{
+	block_count_t count;
+	block_index_t index;
+	kmem_ref_t tag;
+
+	tag = slab_map_get(objp);
+
+	if (!is_large_tag(tag))
+		return -1;
+
+	// Aligned buffers may point inside the run, the tag holds its start
+	index = large_index(tag);
+	count = large_block_count(tag);
+
+	if (__atomic_load_n(&large_sampled, __ATOMIC_RELAXED) && profile_free(buddy_block_addr(index)))
+		__atomic_fetch_sub(&large_sampled, 1, __ATOMIC_RELAXED);
+
+	slab_map_set(buddy_block_addr(index), count, 0);
+
+	mem_free(buddy_block_addr(index), count);
+
+	return 0;
+}
+
+
+// Allocate one memmory buffer (*zero set if it is known to be zero)
+void *kmalloc_buff(size_t size, char *zero)
+{
+	unsigned int order;
+	void *buff = NULL;
+	kmem_cache_t *cachep;
+
+	arg_check_null(size != 0);
+
+	// Past the size-N buffers whole blocks are handed out without rounding to a power of two
+	if (size > KMALLOC_MAX_SIZE)
+		return kmalloc_large(size, zero);
+
+	order = calc_buff_order(size);
+	
+	cachep = &(kmem_ctrl->buffers[order - MIN_BUFF_ORDER].cache);
+
+	// Each size class has its own lock
+	wait(&(cachep->mutex));
+
+	kmem_ctrl->buffers[order - MIN_BUFF_ORDER].used = 1;
+	
+	buff = kmem_cache_alloc_obj(cachep, zero);
+	ret_check_null(buff, err_buff_alloc, &(cachep->mutex));
+	
+	signal(&(cachep->mutex));
+
+	if (profile_tick(cachep->object_size))
+		kmem_cache_sample(cachep, cachep, buff);
+
+	return buff;
+
+}
+
+
+// Allocate one memmory buffer
+void *kmalloc(size_t size)
+{
+	return kmalloc_buff(size, NULL);
+}
+
+
+// Allocate one zero filled memmory buffer
+void *kzalloc(size_t size)
+{
+	void *buff;
+	char zero = 0;
+
+	buff = kmalloc_buff(size, &zero);
+
+	// Fresh objects and blocks are already zero
+	if (buff && !zero)
+		memset(buff, 0, size);
+
+	return buff;
+}
+
+
+// Allocate one small memmory buffer aligned to align
+void *kmalloc_aligned(size_t size, size_t align)
+{
+	char *buff;
+
+	arg_check_null(is_power_of_two(align));
+
+	// Size-N buffers are aligned to min(N, CACHE_L1_LINE_SIZE)
+	if (align <= CACHE_L1_LINE_SIZE && size <= KMALLOC_MAX_SIZE)
+		return kmalloc(size > align ? size : align);
+
+	// Large buffers start on a block, so they are aligned up to BLOCK_SIZE when the heap itself is
+	if (size > KMALLOC_MAX_SIZE && align <= BLOCK_SIZE && ((uintptr_t)buddy_block_addr(0) & (align - 1)) == 0)
+		return kmalloc(size);
+
+	buff = (char*)kmalloc(size + align - 1);
+
+	if (buff == NULL)
+		return NULL;
+
+	return align_ptr(buff, align);
+}
+
+
+// Set one memmory buffer free
+void kfree(const void *objp)
+{
+	kmem_cache_t *cachep;
+	slab_t *slab;
+	int ret = -1;
+
+	arg_check(objp != NULL);
+
+	// The map entry of a live buffer does not change, so the lookup needs no lock
+	slab = slab_find(objp);
+
+	if (slab && is_buffer_cache(slab_cache(slab)))
+	{
+		cachep = slab_cache(slab);
+
+		wait(&(cachep->mutex));
+
+		ret = slab_free_object(slab, (void*)objp);
+
+		signal(&(cachep->mutex));
+	}
+	else if (slab == NULL)
+	{
+		ret = kfree_large(objp);
+
+		if (ret == 0)
+			kmem_wake_all();
+	}
+
+	if (ret != 0)
+		print_error(err_buff_free);
+
+}
+
+
+// Set one memmory buffer of known size free (the size gives the cache, so only the slab entry of the block map is read)
+void kfree_sized(const void *objp, size_t size)
+{
+	kmem_cache_t *cachep;
+	slab_t *slab;
+	int ret;
+
+	arg_check(objp != NULL && size != 0);
+
+	if (size > KMALLOC_MAX_SIZE)
+	{
+		ret = kfree_large(objp);
+
+		if (ret == 0)
+			kmem_wake_all();
+	}
+	else
+	{
+		cachep = &(kmem_ctrl->buffers[calc_buff_order(size) - MIN_BUFF_ORDER].cache);
+		slab = ptr_of(slab_t*, __atomic_load_n(&block_map[buddy_index_of((void*)objp)], __ATOMIC_RELAXED));
+
+		// The size must be the one the buffer was allocated with
+		val_exp(slab != NULL && slab_cache(slab) == cachep);
+
+		wait(&(cachep->mutex));
+
+		ret = slab_free_object(slab, (void*)objp);
+
+		signal(&(cachep->mutex));
+	}
+
+	if (ret != 0)
+		print_error(err_buff_free);
+}
+
+
+// Usable bytes from objp to the end of its kmalloc buffer (0 if objp is not in one)
+size_t ksize(const void *objp)
+{
+	kmem_cache_t *cachep;
+	slab_t *slab;
+	kmem_ref_t tag;
+	char *start;
+	size_t size = 0;
+
+	arg_check_null(objp != NULL);
+
+	// Slab layout and large buffer tags do not change while the buffer is live
+	slab = slab_find(objp);
+	tag = slab_map_get(objp);
+
+	if (slab && is_buffer_cache(slab_cache(slab)))
+	{
+		cachep = slab_cache(slab);
+		start = (char*)slab_objects(slab);
+
+		if ((char*)objp >= start && (char*)objp < start + cachep->obj_per_slab*cachep->object_size)
+			size = cachep->object_size - ((char*)objp - start) % cachep->object_size;
+	}
+	else if (is_large_tag(tag))
+	{
+		start = (char*)buddy_block_addr(large_index(tag));
+		size = size_in_bytes(large_block_count(tag)) - ((char*)objp - start);
+	}
+
+	return size;
+}
+
+
+// Print cache info
+void kmem_cache_info(kmem_cache_t *cachep)
+{
+	unsigned int total_obj, used_obj, total_slabs, i;
+	double usage = 0;
+	slab_t *slab;
+	kmem_cache_t *alias = cachep;
+
+	arg_check(cachep != NULL);
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	kmem_cache_remote_drain(cachep);
+
+	total_slabs = cachep->slab_count[empty] + cachep->slab_count[partial] + cachep->slab_count[full];
+
+	total_obj = total_slabs * cachep->obj_per_slab;
+
+	used_obj = 0;
+
+	for (i = 0; i < PARTIAL_BUCKETS; i++)
+	{
+		slab = cache_head(cachep, LIST_PARTIAL(i));
+		while (slab)
+		{
+			used_obj += slab->used_count;
+			slab = slab_next(slab);
+		}
+	}
+
+	used_obj += cachep->slab_count[full] * cachep->obj_per_slab;
+
+	if(total_obj)
+		usage = 100 * ((double)used_obj / total_obj);
+
+	printf("\nCache info\n");
+	printf("Name: %s\n",alias->name);
+	printf("Object size: %zu\n",cachep->object_size);
+	printf("Cache size in blocks: %llu\n", size_in_blocks(sizeof(kmem_cache_t)) + total_slabs*(cachep->slab_blocks));
+	printf("Number of slabs: %d\n", total_slabs);
+	printf("Objects per slab: %d\n", cachep->obj_per_slab);
+	printf("Used space: %.1f%%\n", usage);
+
+	if (alias != cachep)
+		printf("Merged into %s with %u caches, %u objects in use here\n", cachep->name, cachep->aliases, __atomic_load_n(&(alias->alias_used), __ATOMIC_RELAXED));
+
+	printf("\n");
+
+	signal(&(cachep->mutex));
+
+}
+
+
+// Print cache error
+int kmem_cache_error(kmem_cache_t *cachep)
+{
+	arg_check_null(cachep != NULL);
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	error_code_t error = cachep->error;
+
+	if (error)
+	{
+		print_error(error);
+	}
+
+	signal(&(cachep->mutex));
+
+	return error;
+}
+
+
+
+
+
+/*
+	Refill worker
+*/
+
+#ifdef KMEM_POSIX
+
+// Worker thread state (guarded by refill_wait_mutex)
+pthread_t refill_thread;
+pthread_mutex_t refill_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refill_cond = PTHREAD_COND_INITIALIZER;
+unsigned int refill_period_ms;
+char refill_running;
+char refill_stopping;
+
+// Set when a cache fell below its low watermark since the last pass
+char refill_pending;
+
+
+// Wake the refill worker (called with a cache lock held, so it must not block long)
+void kmem_refill_kick(void)
+{
+	if (!__atomic_load_n(&refill_running, __ATOMIC_RELAXED) || __atomic_exchange_n(&refill_pending, 1, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&refill_wait_mutex);
+	pthread_cond_signal(&refill_cond);
+	pthread_mutex_unlock(&refill_wait_mutex);
+}
+
+#else
+
+// No worker without POSIX threads
+void kmem_refill_kick(void)
+{
+}
+
+#endif
+
+
+// Build slabs until the cache is back at its low watermark
+// Requests served from the new slabs are appended at tail, returns the new tail
+kmem_waiter_t **kmem_cache_refill(kmem_cache_t *cachep, kmem_waiter_t **tail)
+{
+	slab_t *slab;
+	index_t index;
+
+	for (;;)
+	{
+		wait(&(cachep->mutex));
+
+		if (cachep->free_objects >= cachep->low_watermark)
+		{
+			signal(&(cachep->mutex));
+			break;
+		}
+
+		index = cachep->next_offset;
+		cachep->next_offset = (index + 1) % cachep->max_alignments;
+
+		signal(&(cachep->mutex));
+
+		// Buddy allocation and constructors run without the cache lock
+		slab = slab_alloc(cachep, index);
+
+		if (slab == NULL)
+			break;
+
+		wait(&(cachep->mutex));
+
+		kmem_cache_add_slab(cachep, slab);
+		tail = kmem_cache_serve(cachep, tail, 0);
+
+		signal(&(cachep->mutex));
+	}
+
+	return tail;
+}
+
+
+// Refill every cache below its low watermark
+void kmem_refill_pass(void)
+{
+	kmem_waiter_t *served = NULL, **tail = &served;
+	kmem_cache_t *cache;
+
+	wait(&refill_mutex);
+
+	wait(sem);
+	cache = cache_next(&(kmem_ctrl->cache));
+	signal(sem);
+
+	while (cache)
+	{
+		if (cache->low_watermark)
+			tail = kmem_cache_refill(cache, tail);
+
+		wait(sem);
+		cache = cache_next(cache);
+		signal(sem);
+	}
+
+	signal(&refill_mutex);
+
+	// Callbacks may create or destroy caches, which takes refill_mutex
+	kmem_waiters_complete(served);
+}
+
+
+#ifdef KMEM_POSIX
+
+// Refill worker body: a pass on every kick and every period
+void *kmem_refill_worker(void *arg)
+{
+	struct timespec deadline;
+
+	(void)arg;
+
+	pthread_mutex_lock(&refill_wait_mutex);
+
+	while (!refill_stopping)
+	{
+		if (!__atomic_load_n(&refill_pending, __ATOMIC_RELAXED))
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += refill_period_ms / 1000;
+			deadline.tv_nsec += (long)(refill_period_ms % 1000) * 1000000;
+
+			if (deadline.tv_nsec >= 1000000000)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			pthread_cond_timedwait(&refill_cond, &refill_wait_mutex, &deadline);
+
+			if (refill_stopping)
+				break;
+		}
+
+		__atomic_store_n(&refill_pending, 0, __ATOMIC_RELAXED);
+
+		pthread_mutex_unlock(&refill_wait_mutex);
+		kmem_refill_pass();
+		pthread_mutex_lock(&refill_wait_mutex);
+	}
+
+	pthread_mutex_unlock(&refill_wait_mutex);
+
+	return NULL;
+}
+
+
+// Start the refill worker (returns 0 on success)
+int kmem_refill_start(unsigned int period_ms)
+{
+	int ret = 0;
+
+#ifdef KMEM_SINGLE_THREAD
+	// The worker would race with the caller without locks
+	return -1;
+#endif
+
+	pthread_mutex_lock(&refill_wait_mutex);
+
+	if (!refill_running)
+	{
+		refill_period_ms = period_ms ? period_ms : 1;
+		refill_stopping = 0;
+
+		if (pthread_create(&refill_thread, NULL, kmem_refill_worker, NULL) == 0)
+			__atomic_store_n(&refill_running, 1, __ATOMIC_RELAXED);
+		else
+			ret = -1;
+	}
+
+	pthread_mutex_unlock(&refill_wait_mutex);
+
+	return ret;
+}
+
+
+// Stop the refill worker and wait for it to finish its pass
+void kmem_refill_stop(void)
+{
+	pthread_mutex_lock(&refill_wait_mutex);
+
+	if (!refill_running)
+	{
+		pthread_mutex_unlock(&refill_wait_mutex);
+		return;
+	}
+
+	refill_stopping = 1;
+	__atomic_store_n(&refill_running, 0, __ATOMIC_RELAXED);
+	pthread_cond_signal(&refill_cond);
+
+	pthread_mutex_unlock(&refill_wait_mutex);
+
+	pthread_join(refill_thread, NULL);
+}
+
+#else
+
+// Start the refill worker (needs POSIX threads)
+int kmem_refill_start(unsigned int period_ms)
+{
+	(void)period_ms;
+	return -1;
+}
+
+// Stop the refill worker
+void kmem_refill_stop(void)
+{
+}
+
+#endif
+
+
+// Set the free-object count below which the refill worker grows the cache (0 - off)
+void kmem_cache_set_low_watermark(kmem_cache_t *cachep, unsigned int low_watermark)
+{
+	arg_check(cachep != NULL);
+
+	cachep = cache_store(cachep);
+
+	wait(&(cachep->mutex));
+
+	cachep->low_watermark = low_watermark;
+
+	if (cachep->free_objects < low_watermark)
+		kmem_refill_kick();
+
+	signal(&(cachep->mutex));
+}
+
+
+
+
+/*
+	Telemetry
+*/
+
+#ifdef KMEM_POSIX
+
+// Publisher thread state (guarded by telemetry_wait_mutex)
+pthread_t telemetry_thread;
+pthread_mutex_t telemetry_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t telemetry_cond = PTHREAD_COND_INITIALIZER;
+unsigned int telemetry_period_ms;
+char telemetry_running;
+char telemetry_stopping;
+
+// Published segment and its shared memory name (guarded by telemetry_publish_mutex)
+pthread_mutex_t telemetry_publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+kmem_telemetry_t *telemetry;
+char telemetry_name[256];
+
+// Counters gathered before they are copied into the segment, so the segment is written in one short burst
+kmem_telemetry_t telemetry_snapshot;
+
+
+// Copy the counters of cachep into entry (the lock guarding cachep is held)
+void kmem_telemetry_cache(kmem_telemetry_cache_t *entry, kmem_cache_t *cachep)
+{
+	snprintf(entry->name, sizeof(entry->name), "%s", cachep->name);
+
+	entry->object_size = cachep->object_size;
+	entry->slab_blocks = cachep->slab_blocks;
+	entry->obj_per_slab = cachep->obj_per_slab;
+
+	entry->slabs = cachep->slab_count[empty] + cachep->slab_count[partial] + cachep->slab_count[full];
+	entry->empty_slabs = cachep->slab_count[empty];
+	entry->free_objects = cachep->free_objects;
+	entry->allocs = cachep->alloc_count;
+	entry->frees = cachep->free_count;
+}
+
+
+// Add cachep to the snapshot (the lock guarding cachep is held, aliases are counted in the cache holding their objects)
+void kmem_telemetry_add(kmem_cache_t *cachep)
+{
+	kmem_telemetry_t *snap = &telemetry_snapshot;
+
+	if (cachep->backing)
+		return;
+
+	if (snap->cache_count == TELEMETRY_MAX_CACHES)
+	{
+		snap->dropped_caches++;
+		return;
+	}
+
+	kmem_telemetry_cache(&(snap->caches[snap->cache_count++]), cachep);
+}
+
+
+// Gather the counters of the buddy allocator and of every cache into the snapshot
+void kmem_telemetry_gather(void)
+{
+	kmem_telemetry_t *snap = &telemetry_snapshot;
+	kmem_cache_t *cache, *prev;
+	struct timespec now;
+	unsigned int i;
+
+	snap->magic = TELEMETRY_MAGIC;
+	snap->version = TELEMETRY_VERSION;
+	snap->cache_count = 0;
+	snap->dropped_caches = 0;
+	snap->block_size = BLOCK_SIZE;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	snap->timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	wait(buddy_sem);
+
+	snap->total_blocks = buddy_block_count();
+	snap->free_blocks = buddy_free_block_count();
+
+	for (i = 0; i < TELEMETRY_MAX_ORDERS; i++)
+		snap->free_chunks[i] = i < MAX_ORDER_LIMIT ? buddy_free_chunks(i) : 0;
+
+	signal(buddy_sem);
+
+	// The cache of cache descriptors is guarded by the cache list mutex
+	wait(sem);
+	kmem_telemetry_add(&(kmem_ctrl->cache));
+	signal(sem);
+
+	for (i = 0; i < SIZE_N_COUNT; i++)
+	{
+		wait(&(kmem_ctrl->buffers[i].cache.mutex));
+		kmem_telemetry_add(&(kmem_ctrl->buffers[i].cache));
+		signal(&(kmem_ctrl->buffers[i].cache.mutex));
+	}
+
+	// Hand over hand: a cache is unlinked only with its mutex and the one before it held, so the cache reached stays valid
+	prev = &(kmem_ctrl->cache);
+	wait(&(prev->mutex));
+
+	while ((cache = cache_next(prev)) != NULL)
+	{
+		wait(&(cache->mutex));
+		signal(&(prev->mutex));
+
+		kmem_telemetry_add(cache);
+		prev = cache;
+	}
+
+	signal(&(prev->mutex));
+}
+
+
+// Refresh the published counters now
+void kmem_telemetry_publish(void)
+{
+	kmem_telemetry_t *snap = &telemetry_snapshot;
+	uint32_t seq;
+
+	pthread_mutex_lock(&telemetry_publish_mutex);
+
+	if (telemetry == NULL)
+	{
+		pthread_mutex_unlock(&telemetry_publish_mutex);
+		return;
+	}
+
+	kmem_telemetry_gather();
+
+	// Readers never block the publisher, they retry when seq is odd or moved during their copy
+	seq = telemetry->seq;
+	__atomic_store_n(&(telemetry->seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&(telemetry->magic), &(snap->magic), (char*)&(snap->caches[snap->cache_count]) - (char*)&(snap->magic));
+
+	__atomic_store_n(&(telemetry->seq), seq + 2, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&telemetry_publish_mutex);
+}
+
+
+// Publisher body: a refresh every period
+void *kmem_telemetry_worker(void *arg)
+{
+	struct timespec deadline;
+
+	(void)arg;
+
+	pthread_mutex_lock(&telemetry_wait_mutex);
+
+	while (!telemetry_stopping)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += telemetry_period_ms / 1000;
+		deadline.tv_nsec += (long)(telemetry_period_ms % 1000) * 1000000;
+
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&telemetry_cond, &telemetry_wait_mutex, &deadline);
+
+		if (telemetry_stopping)
+			break;
+
+		pthread_mutex_unlock(&telemetry_wait_mutex);
+		kmem_telemetry_publish();
+		pthread_mutex_lock(&telemetry_wait_mutex);
+	}
+
+	pthread_mutex_unlock(&telemetry_wait_mutex);
+
+	return NULL;
+}
+
+
+// Map the shared memory object name as the telemetry segment (returns 0 on success)
+int kmem_telemetry_map(const char *name)
+{
+	void *segment;
+	int fd;
+
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, sizeof(kmem_telemetry_t)) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	segment = mmap(NULL, sizeof(kmem_telemetry_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (segment == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return -1;
+	}
+
+	strcpy(telemetry_name, name);
+	telemetry = (kmem_telemetry_t*)segment;
+
+	return 0;
+}
+
+
+// Publish allocator counters in a shared memory object, refreshed every period_ms (returns 0 on success)
+int kmem_telemetry_start(const char *name, unsigned int period_ms)
+{
+	int ret;
+
+	if (name == NULL || strlen(name) >= sizeof(telemetry_name))
+	{
+		print_error(err_arg);
+		return -1;
+	}
+
+#ifdef KMEM_SINGLE_THREAD
+	// The publisher would race with the caller without locks
+	if (period_ms)
+		return -1;
+#endif
+
+	pthread_mutex_lock(&telemetry_publish_mutex);
+	ret = telemetry ? -1 : kmem_telemetry_map(name);
+	pthread_mutex_unlock(&telemetry_publish_mutex);
+
+	if (ret)
+	{
+		print_error(err_telemetry);
+		return ret;
+	}
+
+	kmem_telemetry_publish();
+
+	if (period_ms == 0)
+		return 0;
+
+	pthread_mutex_lock(&telemetry_wait_mutex);
+
+	telemetry_period_ms = period_ms;
+	telemetry_stopping = 0;
+
+	if (pthread_create(&telemetry_thread, NULL, kmem_telemetry_worker, NULL) == 0)
+		telemetry_running = 1;
+	else
+		ret = -1;
+
+	pthread_mutex_unlock(&telemetry_wait_mutex);
+
+	if (ret)
+		kmem_telemetry_stop();
+
+	return ret;
+}
+
+
+// Stop publishing and remove the shared memory object
+void kmem_telemetry_stop(void)
+{
+	char running;
+
+	pthread_mutex_lock(&telemetry_wait_mutex);
+
+	running = telemetry_running;
+	telemetry_running = 0;
+	telemetry_stopping = 1;
+	pthread_cond_signal(&telemetry_cond);
+
+	pthread_mutex_unlock(&telemetry_wait_mutex);
+
+	if (running)
+		pthread_join(telemetry_thread, NULL);
+
+	pthread_mutex_lock(&telemetry_publish_mutex);
+
+	if (telemetry)
+	{
+		munmap(telemetry, sizeof(kmem_telemetry_t));
+		shm_unlink(telemetry_name);
+		telemetry = NULL;
+	}
+
+	pthread_mutex_unlock(&telemetry_publish_mutex);
+}
+
+#else
+
+// Publish allocator counters (needs POSIX shared memory)
+int kmem_telemetry_start(const char *name, unsigned int period_ms)
+{
+	(void)name;
+	(void)period_ms;
+	print_error(err_telemetry);
+	return -1;
+}
+
+// Refresh the published counters
+void kmem_telemetry_publish(void)
+{
+}
+
+// Stop publishing
+void kmem_telemetry_stop(void)
+{
+}
+
+#endif
+
+
+
+
+
+/*
+	Fork
+*/
+
+// Take every allocator lock, so the child does not inherit one held by a thread that is not copied
+void kmem_fork_prepare(void)
+{
+	kmem_cache_t *cache;
+	unsigned int i;
+
+	if (kmem_ctrl == NULL)
+		return;
+
+#ifdef KMEM_POSIX
+	pthread_mutex_lock(&telemetry_publish_mutex);
+#endif
+
+	wait(&refill_mutex);
+	wait(sem);
+
+	for (cache = cache_next(&(kmem_ctrl->cache)); cache; cache = cache_next(cache))
+	{
+		wait(&(cache->mutex));
+	}
+
+	for (i = 0; i < SIZE_N_COUNT; i++)
+	{
+		wait(&(kmem_ctrl->buffers[i].cache.mutex));
+	}
+
+	profile_lock();
+	wait(buddy_sem);
+
+	// Taken with cache locks held when a worker is kicked, so they come last
+#ifdef KMEM_POSIX
+	pthread_mutex_lock(&refill_wait_mutex);
+	pthread_mutex_lock(&telemetry_wait_mutex);
+#endif
+}
+
+
+// Release the locks taken by kmem_fork_prepare
+void kmem_fork_release(void)
+{
+	kmem_cache_t *cache;
+	unsigned int i;
+
+	signal(buddy_sem);
+	profile_unlock();
+
+	for (i = 0; i < SIZE_N_COUNT; i++)
+	{
+		signal(&(kmem_ctrl->buffers[i].cache.mutex));
+	}
+
+	for (cache = cache_next(&(kmem_ctrl->cache)); cache; cache = cache_next(cache))
+	{
+		signal(&(cache->mutex));
+	}
+
+	signal(sem);
+	signal(&refill_mutex);
+
+#ifdef KMEM_POSIX
+	pthread_mutex_unlock(&telemetry_publish_mutex);
+#endif
+}
+
+
+// Parent side of fork
+void kmem_fork_parent(void)
+{
+	if (kmem_ctrl == NULL)
+		return;
+
+#ifdef KMEM_POSIX
+	pthread_mutex_unlock(&telemetry_wait_mutex);
+	pthread_mutex_unlock(&refill_wait_mutex);
+#endif
+
+	kmem_fork_release();
+}
+
+
+// Child side of fork, where only the forking thread exists
+void kmem_fork_child(void)
+{
+	if (kmem_ctrl == NULL)
+		return;
+
+#ifdef KMEM_POSIX
+	// The workers are not copied, their waits start over
+	pthread_mutex_init(&refill_wait_mutex, NULL);
+	pthread_cond_init(&refill_cond, NULL);
+	refill_running = refill_stopping = refill_pending = 0;
+
+	pthread_mutex_init(&telemetry_wait_mutex, NULL);
+	pthread_cond_init(&telemetry_cond, NULL);
+	telemetry_running = telemetry_stopping = 0;
+
+	// The segment belongs to the parent, the child must not publish into it or unlink it
+	if (telemetry)
+	{
+		munmap(telemetry, sizeof(kmem_telemetry_t));
+		telemetry = NULL;
+	}
+#endif
+
+	kmem_fork_release();
+}
+
+
+
+
+
+/*
+	Persistent heap
+*/
+
+// Reset the per-process state of a resumed cache
+void kmem_cache_resume(kmem_cache_t *cachep)
+{
+	initMutex(&(cachep->mutex));
+
+	cachep->owner = current_thread();
+
+	// Requests queued by the previous process are gone with it
+	cachep->wait_head = cachep->wait_tail = NULL;
+
+	// Code addresses do not survive a restart, kmem_cache_create binds them again
+	if (cachep->ctor || cachep->dtor || cachep->reloc)
+		cachep->resumed = 1;
+
+	cachep->ctor = NULL;
+	cachep->dtor = NULL;
+	cachep->reloc = NULL;
+}
+
+
+// Forget the current heap, nothing in it is used after this
+void kmem_forget(void)
+{
+	kmem_ctrl = NULL;
+	kmem_base = NULL;
+	sem = NULL;
+	buddy_sem = NULL;
+	block_map_release();
+	block_map = NULL;
+	kmem_waiting = 0;
+	large_sampled = 0;
+}
+
+
+// Resume an allocator initialized earlier in space (returns 0 on success)
+int kmem_resume(void *space, size_t size)
+{
+	kmem_cache_t *cache;
+	kmem_ref_t root;
+	unsigned int i;
+
+	kmem_base = space;
+	buddy_attach(space);
+
+	root = *(kmem_ref_t*)kernel_ctrl_first();
+
+	if (root == 0 || root + sizeof(kmem_ctrl_t) > size || size_in_bytes(buddy_block_count()) > size)
+		return -1;
+
+	kmem_ctrl = ptr_of(kmem_ctrl_t*, root);
+
+	// A block map outside the heap went away with the process that made it
+	if (kmem_ctrl->magic != KMEM_MAGIC || kmem_ctrl->layout != sizeof(kmem_ctrl_t) || kmem_ctrl->block_map == 0)
+	{
+		kmem_ctrl = NULL;
+		return -1;
+	}
+
+	// Every link in the heap is a reference, only these globals need the new address
+	sem = ptr_of(mutex_t, kmem_ctrl->sem);
+	buddy_sem = ptr_of(mutex_t, kmem_ctrl->buddy_sem);
+	block_map_release();
+	block_map = ptr_of(kmem_ref_t*, kmem_ctrl->block_map);
+
+	// Locks held by the previous process are released
+	initMutex(sem);
+	initMutex(buddy_sem);
+	initMutex(&refill_mutex);
+
+	kmem_cache_resume(&(kmem_ctrl->cache));
+
+	for (i = 0; i < SIZE_N_COUNT; i++)
+	{
+		kmem_cache_resume(&(kmem_ctrl->buffers[i].cache));
+	}
+
+	for (cache = cache_next(&(kmem_ctrl->cache)); cache; cache = cache_next(cache))
+	{
+		kmem_cache_resume(cache);
+	}
+
+	return 0;
+}
+
+
+#ifdef KMEM_POSIX
+
+// Open heap file, held open with an exclusive lock while its heap is in use
+int heap_fd = -1;
+
+// Mapping of the heap file (the lock lasts as long as the mapping)
+void *heap_space;
+size_t heap_size;
+
+
+// Close the heap file, another process may take it after this
+void heap_file_close(void)
+{
+	if (heap_space)
+		munmap(heap_space, heap_size);
+
+	if (heap_fd >= 0)
+		close(heap_fd);
+
+	heap_fd = -1;
+	heap_space = NULL;
+	heap_size = 0;
+}
+
+
+// Open and lock the heap file at path (returns the descriptor, -1 on error)
+int heap_file_open(const char *path, int flags)
+{
+	int fd;
+
+	// The previous heap goes first: its workers stop, its file is unmapped and unlocked
+	kmem_refill_stop();
+	kmem_telemetry_stop();
+	heap_file_close();
+	kmem_forget();
+
+	fd = open(path, flags, 0600);
+
+	if (fd < 0)
+	{
+		print_error(err_heap_file);
+		return -1;
+	}
+
+	// Two processes allocating from one heap would corrupt it, so a second attach is refused
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+	{
+		close(fd);
+		print_error(errno == EWOULDBLOCK ? err_heap_busy : err_heap_file);
+		return -1;
+	}
+
+	heap_fd = fd;
+
+	return fd;
+}
+
+
+// Initialize allocator in a new heap file
+int kmem_init_file(const char *path, size_t size)
+{
+	void *space;
+	int fd;
+
+	if (path == NULL || size < 2 * BLOCK_SIZE)
+	{
+		print_error(err_arg);
+		return -1;
+	}
+
+	fd = heap_file_open(path, O_RDWR | O_CREAT);
+
+	if (fd < 0)
+		return -1;
+
+	size = size / BLOCK_SIZE * BLOCK_SIZE;
+
+	// Truncated only once locked, a file in use elsewhere is left alone
+	space = ftruncate(fd, 0) == 0 && ftruncate(fd, (off_t)size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+	if (space == MAP_FAILED)
+	{
+		heap_file_close();
+		print_error(err_heap_file);
+		return -1;
+	}
+
+	heap_space = space;
+	heap_size = size;
+
+	// A new file reads as zeros
+	kmem_init_zeroed(space, size / BLOCK_SIZE);
+
+	return 0;
+}
+
+
+// Map an existing heap file and resume its caches
+int kmem_attach(const char *path)
+{
+	struct stat st;
+	void *space;
+	int fd;
+
+	if (path == NULL)
+	{
+		print_error(err_arg);
+		return -1;
+	}
+
+	fd = heap_file_open(path, O_RDWR);
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) != 0 || st.st_size < 2 * BLOCK_SIZE)
+	{
+		heap_file_close();
+		print_error(err_heap_file);
+		return -1;
+	}
+
+	space = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (space != MAP_FAILED)
+	{
+		heap_space = space;
+		heap_size = (size_t)st.st_size;
+	}
+
+	if (space == MAP_FAILED || kmem_resume(space, (size_t)st.st_size) != 0)
+	{
+		heap_file_close();
+		kmem_forget();
+		print_error(err_heap_file);
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+// Initialize allocator in a new heap file (needs mmap)
+int kmem_init_file(const char *path, size_t size)
+{
+	(void)path;
+	(void)size;
+	print_error(err_heap_file);
+	return -1;
+}
+
+// Map an existing heap file (needs mmap)
+int kmem_attach(const char *path)
+{
+	(void)path;
+	print_error(err_heap_file);
+	return -1;
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+	Standard allocator and memory_resource
+
+	Containers and pmr containers on the allocator, checked for the
+	contents they keep, construction and destruction of their elements,
+	alignment and where the memory comes from.
+*/
+
+#include "test.h"
+#include "kmem_allocator.hpp"
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <vector>
+
+// Heap blocks (16 MB)
+#define HEAP_BLOCKS 4096
+
+
+// Counts its constructions and destructions
+struct counted
+{
+	static int alive;
+	long value;
+
+	explicit counted(long value) : value(value)
+	{
+		alive++;
+	}
+
+	~counted()
+	{
+		alive--;
+	}
+};
+
+int counted::alive = 0;
+
+// Needs more than the default alignment
+struct alignas(64) aligned_line
+{
+	char bytes[80];
+};
+
+
+// Address aligned to align
+static bool is_aligned(const void *ptr, size_t align)
+{
+	return ((uintptr_t)ptr & (align - 1)) == 0;
+}
+
+
+// Containers on kmem::allocator
+void test_allocator(void)
+{
+	std::vector<long, kmem::allocator<long>> values;
+	std::map<int, long, std::less<int>, kmem::allocator<std::pair<const int, long>>> index;
+	std::list<counted, kmem::allocator<counted>> nodes;
+	std::vector<aligned_line, kmem::allocator<aligned_line>> lines(10);
+	kmem::allocator<long> longs;
+	long i;
+
+	for (i = 0; i < 100000; i++)
+		values.push_back(i * 3);
+
+	for (i = 0; i < 100000; i++)
+		check(values[i] == i * 3);
+
+	// Arrays are kmalloc buffers
+	check(ksize(values.data()) >= values.capacity() * sizeof(long));
+
+	for (i = 0; i < 1000; i++)
+		index[(int)((i * 7919) % 1000)] = i;
+
+	check(index.size() == 1000);
+	i = 0;
+
+	for (auto &entry : index)
+		check(entry.first == i++ && (entry.second * 7919) % 1000 == entry.first);
+
+	for (i = 0; i < 500; i++)
+		nodes.emplace_back(i);
+
+	check(counted::alive == 500);
+	nodes.clear();
+	check(counted::alive == 0);
+
+	check(is_aligned(lines.data(), 64));
+
+	check(longs == kmem::allocator<int>());
+	check(!(longs != kmem::allocator<int>()));
+
+	try
+	{
+		(void)longs.allocate((size_t)-1 / 2);
+		check(false);
+	}
+	catch (const std::bad_alloc &)
+	{
+	}
+}
+
+
+// pmr containers on kmem::memory_resource
+void test_memory_resource(void)
+{
+	std::pmr::memory_resource *resource = kmem::get_memory_resource();
+	std::pmr::vector<int> values(resource);
+	std::pmr::map<int, int> index(resource);
+	kmem::memory_resource other;
+	void *mem;
+	int i;
+
+	check(resource == kmem::get_memory_resource());
+	check(resource->is_equal(other));
+	check(!resource->is_equal(*std::pmr::new_delete_resource()));
+
+	for (i = 0; i < 10000; i++)
+		values.push_back(i);
+
+	check(values.back() == 9999);
+	check(ksize(values.data()) >= values.capacity() * sizeof(int));
+
+	for (i = 0; i < 1000; i++)
+		index[i] = -i;
+
+	check(index.size() == 1000 && index[500] == -500);
+
+	mem = resource->allocate(100, 128);
+	check(mem != nullptr && is_aligned(mem, 128));
+	std::memset(mem, 1, 100);
+	resource->deallocate(mem, 100, 128);
+
+	mem = resource->allocate(0);
+	check(mem != nullptr);
+	resource->deallocate(mem, 0);
+
+	mem = resource->allocate(300000);
+	check(mem != nullptr && ksize(mem) >= 300000);
+	resource->deallocate(mem, 300000);
+}
+
+
+int main(void)
+{
+	test_heap(HEAP_BLOCKS);
+
+	test_allocator();
+	test_memory_resource();
+
+	return test_result();
+}
@@ -0,0 +1,165 @@
+/*
+	Queued cache allocations and the C++20 awaiter
+
+	A cache runs out of memory, coroutines co_await an object and resume
+	on the thread whose free satisfies them. Requests that cannot be queued
+	resume at once with nullptr instead of waiting forever.
+*/
+
+#include "test.h"
+#include "object_cache.hpp"
+#include "kmem_async.hpp"
+#include <coroutine>
+#include <vector>
+
+// Heap blocks, small so the cache runs out quickly
+#define HEAP_BLOCKS 64
+
+// Object size
+#define OBJECT_SIZE 2000
+
+
+// Coroutine that starts at once and never suspends at the end
+struct task
+{
+	struct promise_type
+	{
+		task get_return_object()
+		{
+			return task();
+		}
+
+		std::suspend_never initial_suspend()
+		{
+			return std::suspend_never();
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+
+		void return_void()
+		{
+		}
+
+		void unhandled_exception()
+		{
+		}
+	};
+};
+
+// What a coroutine got back
+struct result
+{
+	bool done = false;
+	void *obj = nullptr;
+};
+
+
+// Wait for an object of cachep
+task take(kmem_cache_t *cachep, result *out)
+{
+	out->obj = co_await kmem::alloc_async(cachep);
+	out->done = true;
+}
+
+
+// Wait for storage from the object cache of long
+task take_cached(result *out)
+{
+	out->obj = co_await kmem::object_cache<long>::instance().alloc_async();
+	out->done = true;
+}
+
+
+// Completion of a request queued through the C interface
+void completed(void *obj, void *arg)
+{
+	result *out = static_cast<result*>(arg);
+
+	out->obj = obj;
+	out->done = true;
+}
+
+
+int main(void)
+{
+	std::vector<void*> objects;
+	kmem_cache_t *cachep, *doomed;
+	kmem_waiter_t waiter;
+	result first, second, immediate, cached, failed, queued, orphan;
+	void *obj;
+
+	test_heap(HEAP_BLOCKS);
+
+	cachep = kmem_cache_create("async", OBJECT_SIZE, NULL, NULL);
+	check(cachep != nullptr);
+
+	// A free object is handed out without suspending
+	take(cachep, &immediate);
+	check(immediate.done && immediate.obj != nullptr);
+	objects.push_back(immediate.obj);
+
+	take_cached(&cached);
+	check(cached.done && cached.obj != nullptr);
+	kmem_cache_free(kmem::object_cache<long>::instance().cache(), cached.obj);
+
+	while ((obj = kmem_cache_alloc(cachep)) != nullptr)
+		objects.push_back(obj);
+
+	check(objects.size() > 2);
+
+	// Both wait, in order
+	take(cachep, &first);
+	take(cachep, &second);
+	check(!first.done && !second.done);
+
+	obj = objects.back();
+	objects.pop_back();
+	kmem_cache_free(cachep, obj);
+	check(first.done && first.obj == obj && !second.done);
+
+	obj = objects.back();
+	objects.pop_back();
+	kmem_cache_free(cachep, obj);
+	check(second.done && second.obj == obj);
+
+	objects.push_back(first.obj);
+	objects.push_back(second.obj);
+
+	// The C interface tells a queued request from an allocated object and from an error
+	check(kmem_cache_alloc_async(cachep, &waiter, completed, &queued, &obj) == 1 && obj == nullptr);
+	check(kmem_cache_alloc_cancel(cachep, &waiter) == 1 && !queued.done);
+	check(kmem_cache_alloc_async(nullptr, &waiter, completed, &queued, &obj) == -1 && obj == nullptr);
+
+	// A request that fails resumes at once with nullptr
+	take(nullptr, &failed);
+	check(failed.done && failed.obj == nullptr);
+
+	obj = objects.back();
+	objects.pop_back();
+	kmem_cache_free(cachep, obj);
+	check(kmem_cache_alloc_async(cachep, &waiter, completed, &queued, &obj) == 0 && obj != nullptr && !queued.done);
+	objects.push_back(obj);
+
+	for (void *each : objects)
+		kmem_cache_free(cachep, each);
+
+	objects.clear();
+
+	// A request still waiting when its cache is destroyed gets nullptr
+	doomed = kmem_cache_create("doomed", OBJECT_SIZE, NULL, NULL);
+	check(doomed != nullptr);
+
+	while ((obj = kmem_cache_alloc(doomed)) != nullptr)
+		objects.push_back(obj);
+
+	take(doomed, &orphan);
+	check(!orphan.done);
+
+	kmem_cache_destroy(doomed);
+	check(orphan.done && orphan.obj == nullptr);
+
+	return test_result();
+}
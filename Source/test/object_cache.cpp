@@ -0,0 +1,134 @@
+/*
+	Typed object cache
+
+	Objects constructed in place in a cache per type, kept per thread in
+	magazines that spill to and refill from the slab cache, and owned
+	through object_ptr.
+*/
+
+#include "test.h"
+#include "object_cache.hpp"
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Heap blocks (4 MB)
+#define HEAP_BLOCKS 1024
+
+
+// Counts its constructions and destructions
+struct counted
+{
+	static int alive;
+	long value;
+
+	explicit counted(long value) : value(value)
+	{
+		alive++;
+	}
+
+	~counted()
+	{
+		alive--;
+	}
+};
+
+int counted::alive = 0;
+
+// Constructor that fails
+struct throwing
+{
+	throwing()
+	{
+		throw std::runtime_error("constructor");
+	}
+};
+
+// Needs more than the default alignment
+struct alignas(64) aligned_line
+{
+	char bytes[80];
+};
+
+
+// Address aligned to align
+static bool is_aligned(const void *ptr, size_t align)
+{
+	return ((uintptr_t)ptr & (align - 1)) == 0;
+}
+
+
+// One cache per type, objects constructed in place and given back
+void test_object_cache(void)
+{
+	kmem::object_cache<counted> &cache = kmem::object_cache<counted>::instance();
+	std::vector<counted*> objects;
+	void *storage, *reused;
+	counted *obj;
+	int i;
+
+	check(&cache == &kmem::object_cache<counted>::instance());
+	check(cache.cache() != nullptr);
+	check(cache.cache() != kmem::object_cache<aligned_line>::instance().cache());
+
+	obj = cache.create(7);
+	check(obj != nullptr && obj->value == 7 && counted::alive == 1);
+	cache.destroy(obj);
+	check(counted::alive == 0);
+
+	// More than a magazine, so objects also come from and go back to the slab cache
+	for (i = 0; i < 4 * OBJECT_CACHE_MAGAZINE; i++)
+		objects.push_back(cache.create(i));
+
+	check(counted::alive == 4 * OBJECT_CACHE_MAGAZINE);
+
+	for (i = 0; i < (int)objects.size(); i++)
+		check(objects[i]->value == i);
+
+	for (counted *each : objects)
+		cache.destroy(each);
+
+	check(counted::alive == 0);
+
+	// A failed construction gives the storage back, the next allocation takes it again
+	storage = kmem::object_cache<throwing>::instance().allocate();
+	kmem::object_cache<throwing>::instance().deallocate(storage);
+
+	try
+	{
+		kmem::object_cache<throwing>::instance().create();
+		check(false);
+	}
+	catch (const std::runtime_error &)
+	{
+	}
+
+	reused = kmem::object_cache<throwing>::instance().allocate();
+	check(reused == storage);
+	kmem::object_cache<throwing>::instance().deallocate(reused);
+
+	for (i = 0; i < 2 * OBJECT_CACHE_MAGAZINE; i++)
+	{
+		storage = kmem::object_cache<aligned_line>::instance().allocate();
+		check(storage != nullptr && is_aligned(storage, 64));
+		kmem::object_cache<aligned_line>::instance().deallocate(storage);
+	}
+
+	{
+		kmem::object_ptr<counted> owned = kmem::make<counted>(42);
+
+		check(owned->value == 42 && counted::alive == 1);
+	}
+
+	check(counted::alive == 0);
+}
+
+
+int main(void)
+{
+	test_heap(HEAP_BLOCKS);
+
+	test_object_cache();
+
+	return test_result();
+}
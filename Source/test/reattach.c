@@ -0,0 +1,116 @@
+/*
+	Heap files attached again in the same process
+
+	A heap made by kmem_init_file is attached again while it is still the
+	current heap, then a second file is made and the first one attached
+	once more. Every attach must find the caches and the data left in the
+	file, wherever the new mapping lands.
+*/
+
+#include "test.h"
+#include <string.h>
+#include <unistd.h>
+
+// Objects kept in the heap
+#define OBJECTS 200
+
+// Heap file size
+#define HEAP_SIZE (4 << 20)
+
+
+// Pointers into the heap, moved after every attach
+kmem_cache_t *cache;
+unsigned long *objects[OBJECTS];
+char *marker;
+
+
+// Find the cache again and move the kept pointers into the new mapping
+void relocate(void)
+{
+	kmem_cache_t *found = kmem_cache_create("reattach", 64, NULL, NULL);
+	long moved;
+	int i;
+
+	check(found != NULL);
+
+	if (found == NULL)
+		return;
+
+	// The descriptor keeps its offset in the heap, so it moves like every other object
+	moved = (char*)found - (char*)cache;
+	cache = found;
+	marker += moved;
+
+	for (i = 0; i < OBJECTS; i++)
+		objects[i] = (unsigned long*)((char*)objects[i] + moved);
+}
+
+
+// The kept data is intact
+void check_data(void)
+{
+	int i;
+
+	check(strcmp(marker, "left in the heap") == 0);
+	check(ksize(marker) >= 100);
+
+	for (i = 0; i < OBJECTS; i++)
+		check(objects[i] == NULL || objects[i][0] == (unsigned long)i);
+}
+
+
+int main(void)
+{
+	const char *path = "kmem_reattach_test.heap", *other = "kmem_reattach_other.heap";
+	void *obj;
+	int i;
+
+	check(kmem_init_file(path, HEAP_SIZE) == 0);
+
+	cache = kmem_cache_create("reattach", 64, NULL, NULL);
+	check(cache != NULL);
+
+	for (i = 0; i < OBJECTS; i++)
+	{
+		objects[i] = (unsigned long*)kmem_cache_alloc(cache);
+		objects[i][0] = i;
+	}
+
+	marker = (char*)kmalloc(100);
+	strcpy(marker, "left in the heap");
+
+	// The heap being used is given up for the same file
+	check(kmem_attach(path) == 0);
+	relocate();
+	check_data();
+
+	// The attached heap works, half the objects go back
+	for (i = 0; i < OBJECTS; i += 2)
+	{
+		kmem_cache_free(cache, objects[i]);
+		objects[i] = NULL;
+	}
+
+	obj = kmem_cache_alloc(cache);
+	check(obj != NULL);
+	kmem_cache_free(cache, obj);
+
+	check(kmem_attach(path) == 0);
+	relocate();
+	check_data();
+
+	// A new heap file, then back to the first one
+	check(kmem_init_file(other, HEAP_SIZE) == 0);
+	check(kmem_cache_create("other", 32, NULL, NULL) != NULL);
+
+	check(kmem_attach(path) == 0);
+	relocate();
+	check_data();
+
+	kfree(marker);
+
+	unlink(path);
+	unlink(other);
+
+	return test_result();
+}
@@ -0,0 +1,48 @@
+/*
+	Helpers shared by the tests
+*/
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// Checks that failed so far
+static int test_failures;
+
+// Report a condition that does not hold and carry on
+#define check(condition) do { if (!(condition)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); test_failures++; } } while (0)
+
+// Give the allocator a heap of blocks blocks
+static inline void test_heap(size_t blocks)
+{
+	void *space = aligned_alloc(BLOCK_SIZE, blocks * BLOCK_SIZE);
+
+	if (space == NULL)
+	{
+		fprintf(stderr, "No memory for a heap of %zu blocks\n", blocks);
+		exit(1);
+	}
+
+	kmem_init(space, blocks);
+}
+
+
+// Exit status of the test, with a summary line
+static inline int test_result(void)
+{
+	if (test_failures)
+	{
+		printf("%d checks failed\n", test_failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
+
+
+#endif //TEST_H_
@@ -0,0 +1,169 @@
+/*
+	Live view of the counters published by kmem_telemetry_start
+
+	Usage: kmem_top <shm name> [interval ms]
+	Build: gcc -I../h kmem_top.c -o kmem_top (add -lrt on older glibc)
+*/
+
+#include "telemetry.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Copy attempts before a sample is given up
+#define READ_RETRIES 1000
+
+
+// Consistent copy of the segment (returns 0 on success)
+int telemetry_read(const kmem_telemetry_t *segment, kmem_telemetry_t *copy)
+{
+	uint32_t seq, check;
+	int i;
+
+	for (i = 0; i < READ_RETRIES; i++)
+	{
+		seq = __atomic_load_n(&(segment->seq), __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		memcpy(copy, segment, sizeof(kmem_telemetry_t));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		check = __atomic_load_n(&(segment->seq), __ATOMIC_RELAXED);
+
+		if (seq == check)
+			return copy->magic == TELEMETRY_MAGIC && copy->version == TELEMETRY_VERSION ? 0 : -1;
+	}
+
+	return -1;
+}
+
+
+// Previous sample of the cache named name (NULL if it is new)
+const kmem_telemetry_cache_t *previous_cache(const kmem_telemetry_t *prev, const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < prev->cache_count; i++)
+	{
+		if (strcmp(prev->caches[i].name, name) == 0)
+			return &(prev->caches[i]);
+	}
+
+	return NULL;
+}
+
+
+// Print one sample, rates are taken against prev
+void print_sample(const kmem_telemetry_t *cur, const kmem_telemetry_t *prev)
+{
+	const kmem_telemetry_cache_t *cache, *old;
+	double seconds, occupancy, fragmentation = 0;
+	uint64_t objects, largest = 0;
+	uint32_t i;
+
+	seconds = prev->magic ? (double)(cur->timestamp_ns - prev->timestamp_ns) / 1e9 : 0;
+
+	for (i = 0; i < TELEMETRY_MAX_ORDERS; i++)
+	{
+		if (cur->free_chunks[i])
+			largest = (uint64_t)1 << i;
+	}
+
+	// Share of the free blocks that cannot be handed out as the largest free chunk
+	if (cur->free_blocks)
+		fragmentation = 100.0 * (1.0 - (double)largest / cur->free_blocks);
+
+	printf("\033[H\033[2J");
+	printf("Blocks: %llu total, %llu free (%.1f%%), largest free chunk %llu, fragmentation %.1f%%\n",
+		(unsigned long long)cur->total_blocks, (unsigned long long)cur->free_blocks,
+		cur->total_blocks ? 100.0 * cur->free_blocks / cur->total_blocks : 0.0,
+		(unsigned long long)largest, fragmentation);
+
+	printf("Free chunks by order:");
+	for (i = 0; i < TELEMETRY_MAX_ORDERS; i++)
+	{
+		if (cur->free_chunks[i])
+			printf(" %u:%llu", i, (unsigned long long)cur->free_chunks[i]);
+	}
+	printf("\n\n");
+
+	printf("%-24s %8s %8s %10s %12s %12s %6s\n", "Cache", "Size", "Slabs", "Objects", "Alloc/s", "Free/s", "Used");
+
+	for (i = 0; i < cur->cache_count; i++)
+	{
+		cache = &(cur->caches[i]);
+
+		if (cache->slabs == 0 && cache->allocs == 0)
+			continue;
+
+		old = seconds > 0 ? previous_cache(prev, cache->name) : NULL;
+		objects = cache->slabs * cache->obj_per_slab;
+		occupancy = objects ? 100.0 * (objects - cache->free_objects) / objects : 0;
+
+		printf("%-24s %8llu %8llu %10llu %12.0f %12.0f %5.1f%%\n", cache->name,
+			(unsigned long long)cache->object_size, (unsigned long long)cache->slabs,
+			(unsigned long long)(objects - cache->free_objects),
+			old ? (cache->allocs - old->allocs) / seconds : 0.0,
+			old ? (cache->frees - old->frees) / seconds : 0.0,
+			occupancy);
+	}
+
+	if (cur->dropped_caches)
+		printf("(%llu more caches not published)\n", (unsigned long long)cur->dropped_caches);
+
+	fflush(stdout);
+}
+
+
+int main(int argc, char **argv)
+{
+	static kmem_telemetry_t samples[2];
+	const kmem_telemetry_t *segment;
+	unsigned int interval_ms = 1000, cur = 0;
+	int fd;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <shm name> [interval ms]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 2 && atoi(argv[2]) > 0)
+		interval_ms = atoi(argv[2]);
+
+	fd = shm_open(argv[1], O_RDONLY, 0);
+	if (fd < 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	// Read only, the publisher is never held up by this process
+	segment = (const kmem_telemetry_t*)mmap(NULL, sizeof(kmem_telemetry_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (segment == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	for (;;)
+	{
+		if (telemetry_read(segment, &samples[cur]) == 0)
+		{
+			print_sample(&samples[cur], &samples[cur ^ 1]);
+			cur ^= 1;
+		}
+
+		usleep(interval_ms * 1000);
+	}
+
+	return 0;
+}